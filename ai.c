@@ -20,7 +20,7 @@
  * 
  * Requirements: 
  *  - GCC Compiler
- *  - json-c, libcurl 
+ *  - json-c, libcurl, zlib
  *  - Linux Operating System
  *  - outgoing firewall access to OpenAI API servers
  * 
@@ -32,607 +32,5689 @@
  * ============================================================================
  */
 
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fnmatch.h>
 #include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <json-c/json.h>
 #include <curl/curl.h>
+#include <zlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
 #include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <termios.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <sys/random.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <linux/audit.h>
+#if __has_include(<linux/landlock.h>)
+#include <linux/landlock.h>
+#endif
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #define CONFIG_PATH "/etc/ai/ai.conf"
-#define MAX_CONVERSATION_ENTRIES 25000
+#define CONFIG_CACHE_MAGIC "AICFGv14"
+#define OPENAI_API_URL "https://api.openai.com/v1/chat/completions"
+#define OLLAMA_API_URL "http://127.0.0.1:11434/api/chat"
+#define DEFAULT_MODEL "gpt-4o"
+#define ARENA_BLOCK_SIZE (64 * 1024)
 #define API_KEY_BUFFER_SIZE 200
 #define RESPONSE_BUFFER_SIZE 64000
-#define COMMAND_BUFFER_SIZE 65000       
-#define PADDING 512
 #define MAXTOKENS 500
+#define GZIP_REQUEST_THRESHOLD (32 * 1024)
+#define CONNECT_TIMEOUT 10
+#define REQUEST_TIMEOUT 300
+#define COMMAND_TIMEOUT 60
+#define COMMAND_KILL_GRACE_MS 2000
+#define OUTPUT_HEAD (32 * 1024)
+#define OUTPUT_TAIL (16 * 1024)
+#define OUTPUT_BUDGET (8 * 1024)
+#define CMD_CONCURRENCY 4
+#define CONTEXT_TOKENS 32000
+#define CONTEXT_RECENT 8
+#define COMMAND_STUB_MAX 512
+#define BATCH_CONCURRENCY 8
+#define BATCH_RETRIES 5
+#define RETRY_BACKOFF_MS 1000
+#define RETRY_BACKOFF_MAX_MS 60000
+#define REQUEST_RETRIES 3
+#define HEDGE_PERCENTILE 95
+#define HEDGE_MIN_SAMPLES 20
+#define HEDGE_MIN_MS 200
+#define LATENCY_MAGIC "AILATv1"
+#define LATENCY_WINDOW 64
+#define READONLY_TTL 60
+#define WARMUP_IDLE_MS 10000
+#define READONLY_CACHE_ENTRIES 32
+#define SESSION_LOG_MAGIC "AISESv2"
+#define SESSION_PRUNE_DAYS 30
+#define DAEMON_WORKERS 8
+#define DAEMON_QUEUE_SIZE 64
+#define DAEMON_FRAME_MAX (128 * 1024) // the longest argument or variable execve takes
+#define RESPONSE_CACHE_MAGIC "AIRSPv1"
+#define RESPONSE_CACHE_DIR "/var/cache/ai"
+#define RESPONSE_CACHE_SLOTS 4096
+#define RESPONSE_CACHE_TTL 86400
+#define RESPONSE_CACHE_SIZE (64L * 1024 * 1024)
 
-// Structure for conversation entries
-typedef struct {
-    char role[PADDING];
-    char content[RESPONSE_BUFFER_SIZE+PADDING];
+// Roles are interned so a record only spends one byte on them
+typedef enum {
+    ROLE_SYSTEM,
+    ROLE_USER,
+    ROLE_ASSISTANT
+} ConversationRole;
+
+static const char *const conversation_role_names[] = {
+    [ROLE_SYSTEM] = "system",
+    [ROLE_USER] = "user",
+    [ROLE_ASSISTANT] = "assistant",
+};
+
+// Conversation record: role and length prefix followed by the content bytes (NUL terminated)
+// and the message already serialized as a JSON object, so it is only escaped once
+typedef struct ConversationEntry {
+    uint8_t role;
+    uint32_t length;
+    uint32_t json_length;
+    uint32_t tokens;                 // estimated size of json as the model counts it
+    const char *json;
+    struct ConversationEntry *stub;  // short stand-in for a command result once it is old, or NULL
+    char content[];
 } ConversationEntry;
 
+// Bump allocator block, records are carved out of these and never freed individually
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    size_t bytes_used;
+} Arena;
+
+// Start of a session file under ~/.local/state/ai, records follow
+typedef struct {
+    char magic[8];
+    int64_t created;
+} SessionFileHeader;
+
+enum {
+    SESSION_RECORD_STUB = 1  // the stub of the record before it
+};
+
+// One record of a session file, the content follows. crc covers the header (crc zeroed) and the content,
+// so a record torn by a crash is recognized and cut off
+typedef struct {
+    int64_t timestamp;  // milliseconds since the epoch
+    uint32_t length;
+    uint32_t crc;
+    uint8_t role;
+    uint8_t flags;
+    uint8_t reserved[6];
+} SessionRecord;
+
+// Growable conversation log: records live in the arena, entries only indexes them
+typedef struct {
+    Arena arena;
+    ConversationEntry **entries;
+    size_t count;
+    size_t capacity;
+} ConversationLog;
+
+// Request body as a list of spans, the serialized history is referenced, never copied
+typedef struct {
+    const char *data;
+    size_t length;
+} PayloadSegment;
+
+typedef struct {
+    PayloadSegment *segments;
+    size_t count;
+    size_t capacity;
+    size_t total_length;
+    size_t messages;
+} Payload;
+
+// Growable byte buffer for request and response bodies
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} ByteBuffer;
+
+// Request and reply formats a backend can speak
+typedef enum {
+    API_OPENAI, // chat completions, also llama.cpp server, vLLM and most local servers
+    API_OLLAMA  // ollama's own /api/chat
+} BackendApiKind;
+
+static const char *const backend_api_names[] = {
+    [API_OPENAI] = "openai",
+    [API_OLLAMA] = "ollama",
+};
+
+// Warm connections of one backend in the daemon, its DNS, TLS sessions and connections are pooled apart
+typedef struct {
+    CURLSH *share;
+    pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+} BackendPool;
+
+// Time to the first byte of the last requests to a backend, as saved between runs
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t next;
+    uint32_t ms[LATENCY_WINDOW];
+} LatencySamples;
+
+// The samples of one backend, read from disk the first time a request needs them
+typedef struct {
+    LatencySamples samples;
+    bool loaded;
+} LatencyWindow;
+
+// One server the conversation can go to: the top of ai.conf is "default", every [name] block adds one
+typedef struct {
+    char *name;
+    uint8_t api;          // BackendApiKind
+    char *endpoint;
+    char *model;
+    char *api_key;        // sent as a bearer token, none for most local servers
+    char *headers;        // extra HEADER= lines, newline separated
+    long connect_timeout;
+    long request_timeout;
+    long gzip_threshold;  // 0 for servers that don't take compressed requests
+    BackendPool *pool;    // daemon only
+    LatencyWindow *latency;
+} Backend;
+
+// Settings read from ai.conf, the prompts are joined strings, the rest is typed
+typedef struct {
+    char *prompt;
+    char *added_prompt;
+    Backend *backends;
+    size_t backend_count;
+    char *backend;        // name of the one sessions use unless --backend says otherwise
+    long max_tokens;
+    double temperature;
+    double command_timeout;
+    bool stream;
+    bool cache;
+    long daemon_workers;
+    bool response_cache;
+    char *cache_dir;
+    long cache_ttl;
+    long cache_size;
+    long output_head;
+    long output_tail;
+    bool output_reduce;   // what the model gets of a command's output is cleaned up and squeezed
+    long output_budget;   // bytes per output stream for the model, 0 is no limit
+    bool exec_persistent;
+    bool cmd_batch;
+    long cmd_concurrency;
+    long context_tokens;
+    long context_recent;
+    bool summarize;
+    long batch_concurrency;
+    long batch_retries;
+    bool sessions;
+    long retries;
+    double hedge_percentile;
+    char *readonly;           // READONLY= lines, newline separated: a program name or a pattern for a whole command
+    long readonly_ttl;        // seconds a read-only command's output is reused, 0 is off
+    bool speculate;           // read-only commands start in a sandbox while their approval is asked for
+} AiConfig;
+
+// Header of the binary config cache, it is only valid for the exact file it was built from
+typedef struct {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} ConfigCacheHeader;
+
+// Which config file a process runs with, the daemon only serves clients that would load the same one
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} ConfigIdentity;
+
+// Long-lived HTTP transport, the easy handle keeps its connection alive across turns
+typedef struct {
+    CURL *curl;
+    const Backend *backend;
+    CURLM *multi;           // runs the request and, when it is slow, its hedge side by side
+    CURL *hedge;            // a duplicate of a slow request, whichever answers first is kept
+    CURL *winner;           // the handle the reply is read from, the other one is dropped
+    ByteBuffer flat;        // the payload in one piece for the hedge
+    CURL *warm;             // a HEAD request opening the connection while the user types
+    pthread_t warm_thread;
+    bool warming;           // warm_thread owns multi until it is joined
+    bool warm_cancel;
+    double last_used;       // when the last request ended, a recent connection needs no warming
+    struct curl_slist *headers;
+    struct curl_slist *gzip_headers;
+    const Payload *body;
+    size_t body_segment;
+    size_t body_offset;
+    ByteBuffer compressed;
+    ByteBuffer response;
+    // Streamed reply state, lines are server-sent events or JSON depending on the backend
+    bool streaming;
+    size_t sse_offset;
+    bool stream_done;
+    ByteBuffer message;
+    FILE *out;
+    // Called with the reply up to its first full command, the rest keeps streaming in on drain_thread meanwhile
+    void (*on_command)(void *arg, const char *reply);
+    void *on_command_arg;
+    size_t command_end;     // where that command ends in message, 0 until it is in
+    bool command_asked;
+    pthread_t drain_thread;
+    bool draining;          // drain_thread owns multi until it is joined
+} Transport;
+
+// Command line options, they win over ai.conf
+typedef struct {
+    bool stream;
+    bool stream_set;
+    bool daemon;
+    bool no_daemon;
+    bool cache_stats;
+    bool stats;
+    const char *trace_path;
+    const char *batch_path;
+    const char *backend;
+    const char *resume_id;
+    bool list_sessions;
+    bool prune_sessions;
+    double prune_days;
+} Options;
+
+// Long-lived bash a session sends its commands to when EXECMODE=persistent, pid 0 when not running
+typedef struct {
+    pid_t pid;
+    int in_fd;      // commands go in here
+    int out_fd;
+    int err_fd;
+    int status_fd;  // bash's fd 3, one "<nonce> <exit code>" line per finished command
+} PersistentShell;
+
+// Output of a read-only command, reused while it is younger than READONLYTTL
+typedef struct {
+    char *key;          // the command with its blanks normalized, then the directory it ran in
+    char *result;
+    double stored_at;
+} ReadonlyResult;
+
+// Results of the read-only commands of a session, any other command empties it
+typedef struct {
+    ReadonlyResult entries[READONLY_CACHE_ENTRIES];
+    int count;
+    uint32_t generation;    // bumped by every command that may write
+} ReadonlyCache;
+
+// Phases of a turn measured by --stats and --trace
+enum {
+    PHASE_STARTUP,
+    PHASE_PAYLOAD,
+    PHASE_REQUEST,
+    PHASE_PARSE,
+    PHASE_INPUT,    // waiting on the user
+    PHASE_EXEC,
+    PHASE_COUNT
+};
+
+static const char *const phase_names[] = {
+    [PHASE_STARTUP] = "startup",
+    [PHASE_PAYLOAD] = "payload",
+    [PHASE_REQUEST] = "request",
+    [PHASE_PARSE] = "parse",
+    [PHASE_INPUT] = "input",
+    [PHASE_EXEC] = "exec",
+};
+
+// Counters behind --stats and --trace, nothing is measured unless one of them is on
+typedef struct {
+    bool enabled;
+    bool print;
+    FILE *trace;            // Chrome trace events, one per line
+    uint32_t trace_events;
+    double origin;          // trace timestamps count from here
+    double phase_ms[PHASE_COUNT];
+    double phase_max_ms[PHASE_COUNT];
+    uint32_t phase_count[PHASE_COUNT];
+    uint64_t payload_bytes;
+    uint64_t payload_max;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint32_t cache_hits;
+    double first_byte_ms;   // summed over requests, from libcurl
+    uint32_t commands;
+    double child_wait_ms;   // spawn until exit, summed over commands
+} SessionStats;
+
+// Append-only file the session is written to, opened with the first message
+typedef struct {
+    int fd;
+    bool open;
+    bool failed;
+    bool dirty;     // written since the last fdatasync
+    char id[32];
+} SessionLog;
+
+// Background call condensing the trimmed part of a conversation, the thread only touches this struct
+typedef struct {
+    pthread_t thread;
+    bool started;
+    bool done;      // set by the thread once text is final
+    bool cancel;    // aborts the transfer when the session ends
+    const Backend *backend;
+    size_t upto;    // entries before this index are covered by the summary being made
+    ByteBuffer body;
+    ByteBuffer response;
+    char *text;
+} Summarizer;
+
+typedef struct EarlyApproval EarlyApproval;
+
+// Per-conversation state, the daemon runs one of these for every connected client
+typedef struct {
+    FILE *in;
+    FILE *out;
+    FILE *err;
+    const char *cwd;
+    char **env;                     // what commands run with, the client's own for daemon sessions, else environ
+    bool stream;
+    const Backend *backend;
+    ConversationLog conversation;
+    Transport transport;
+    Payload payload;
+    ByteBuffer payload_header;
+    uint8_t *context_plan;          // what each entry contributes to the next payload
+    size_t context_plan_capacity;
+    ConversationEntry *summary;     // stands in for the non-pinned entries before summary_upto
+    size_t summary_upto;
+    Summarizer summarizer;
+    SessionStats stats;
+    SessionLog log;
+    const char *resume_id;
+    PersistentShell shell;
+    ReadonlyCache readonly;
+    EarlyApproval *approval;        // the answer about a reply's first command, asked while the reply streamed in
+    bool ended;
+    int exit_status;
+} Session;
+
+// Frames between the thin client and the daemon: a type byte, a 4 byte length and the data
+enum {
+    FRAME_ARG = 'A',
+    FRAME_CWD = 'C',
+    FRAME_ENV = 'V',
+    FRAME_CONFIG = 'F',
+    FRAME_START = 'S',
+    FRAME_ACCEPT = 'K',
+    FRAME_REFUSE = 'N',
+    FRAME_STDIN = 'I',
+    FRAME_STDIN_EOF = 'E',
+    FRAME_STDOUT = 'O',
+    FRAME_STDERR = 'R',
+    FRAME_EXIT = 'X'
+};
+
+// stdio cookie turning a FILE into frames on the client socket
+typedef struct {
+    int fd;
+    char type;
+    uint32_t pending;
+    bool eof;
+} FrameStream;
+
+// Accepted clients waiting for a worker
+typedef struct {
+    int fds[DAEMON_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} ClientQueue;
+
+enum {
+    CACHE_SLOT_EMPTY = 0,
+    CACHE_SLOT_USED = 1,
+    CACHE_SLOT_DELETED = 2
+};
+
+// One slot of the response cache index, keyed by a hash of the exact request bytes
+typedef struct {
+    uint64_t hash;
+    uint32_t check;     // crc32 of the request, a second key against hash collisions
+    uint32_t state;
+    uint64_t offset;    // where the response starts in the data file
+    uint32_t length;
+    uint32_t crc;       // crc32 of the response, torn or stale data is never served
+    int64_t created;
+    int64_t last_used;
+} CacheSlot;
+
+// Start of the mapped index file, shared by every ai process using the cache
+typedef struct {
+    char magic[8];
+    uint32_t slot_count;
+    uint32_t entries;
+    uint32_t deleted;
+    uint32_t reserved;
+    uint64_t generation; // suffix of the live data file, bumped by each compaction
+    uint64_t data_size;  // append position in the data file
+    uint64_t live_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t evictions;
+} CacheIndexHeader;
+
+typedef struct {
+    int fd;
+    CacheIndexHeader *header;
+    CacheSlot *slots;
+    size_t map_size;
+    bool failed;
+} ResponseCache;
+
+// Timestamps of one command run, in milliseconds since started
+typedef struct {
+    double started;
+    double spawn_ms;        // fork until the parent got control back
+    double first_output_ms; // negative when the command printed nothing
+    double exit_ms;
+    double total_ms;        // until the output was collected
+} CommandTiming;
+
+// Bounded capture of one output stream: the first head_limit bytes, then a ring with the latest tail_limit bytes
+typedef struct {
+    int fd;
+    ByteBuffer head;
+    size_t head_limit;
+    char *tail;         // allocated once the head is full
+    size_t tail_limit;
+    size_t tail_start;  // oldest byte in the ring
+    size_t tail_length;
+    uint64_t total;     // everything the command wrote, kept or not
+} OutputCapture;
+
+// One command under supervision, a one-shot bash -c or a command sent to the persistent shell
+typedef struct {
+    pid_t pid;                 // process group leader
+    int pidfd;
+    int status_fd;             // persistent shell only, -1 otherwise
+    char nonce[48];
+    char report[128];          // status line being read from status_fd
+    size_t report_length;
+    bool persistent;
+    int interrupt_signal;      // sent to the group on timeout, SIGKILL follows after the grace period
+    double deadline;
+    double kill_at;            // when SIGKILL follows the interrupt, 0 once it was sent
+    double stop_at;            // persistent shell only, when a shell that still has not reported is killed
+    pid_t prior_jobs[16];      // persistent shell only, groups of the jobs it already ran when the command was sent
+    int prior_job_count;
+    OutputCapture captures[2]; // stdout, stderr
+    bool open_streams[2];
+    CommandTiming timing;
+    bool done;
+    bool timed_out;
+    bool exited;               // the process itself is gone
+    int status;                // wait status, or the shell's report turned into one
+    bool readonly;             // its result may be kept for the next time it is proposed
+    uint32_t generation;       // of the read-only cache when it started
+} CommandRun;
+
+// A read-only command started in the sandbox while its approval is asked for
+typedef struct {
+    CommandRun run;
+    pthread_t thread;
+    bool started;
+} Speculation;
+
+// Approval of the first command of a reply asked before the rest of it was in, execute_command picks it up
+struct EarlyApproval {
+    char *command;
+    char answer[10];
+    Speculation spec;
+};
+
+// Commands proposed in one reply, text holds them back to back with their fences removed
+typedef struct {
+    char **commands;
+    int count;
+    ByteBuffer text;
+} CommandList;
+
+// One conversation of --batch, a slot is reused for the next input line once its result is out
+typedef struct {
+    CURL *curl;
+    long index;        // input line, counted from 0
+    int attempts;
+    bool active;       // request in flight
+    bool waiting;      // failed, tried again at retry_at
+    double retry_at;
+    double started;
+    ByteBuffer body;
+    ByteBuffer response;
+} BatchSlot;
+
+// Input of --batch, read without blocking the event loop
+typedef struct {
+    int fd;
+    bool eof;
+    ByteBuffer pending;
+    size_t consumed;   // start of the first unread line in pending
+    long lines;
+} BatchInput;
+
+
+// Function to make room for extra bytes (plus a NUL) in a byte buffer
+bool buffer_reserve(ByteBuffer *buf, size_t extra) {
+    if (buf->length + extra + 1 <= buf->capacity) return true;
+
+    size_t new_capacity = buf->capacity ? buf->capacity : 4096;
+    while (new_capacity < buf->length + extra + 1) new_capacity *= 2;
+
+    char *new_data = realloc(buf->data, new_capacity);
+    if (new_data == NULL) {
+        perror("Failed to allocate buffer");
+        return false;
+    }
+    buf->data = new_data;
+    buf->capacity = new_capacity;
+    return true;
+}
+
+// Function to append bytes to a byte buffer, the content stays NUL terminated
+bool buffer_append(ByteBuffer *buf, const void *data, size_t length) {
+    if (!buffer_reserve(buf, length)) return false;
+    memcpy(buf->data + buf->length, data, length);
+    buf->length += length;
+    buf->data[buf->length] = '\0';
+    return true;
+}
+
+// Function to append formatted text to a byte buffer
+bool buffer_printf(ByteBuffer *buf, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int needed = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (needed < 0 || !buffer_reserve(buf, needed)) return false;
+
+    va_start(ap, fmt);
+    vsnprintf(buf->data + buf->length, needed + 1, fmt, ap);
+    va_end(ap);
+    buf->length += needed;
+    return true;
+}
+
+void buffer_free(ByteBuffer *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->length = buf->capacity = 0;
+}
+
+AiConfig config;
+
+// Function to read the monotonic clock in milliseconds
+static double monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+
+// Function to fill in the defaults used when ai.conf does not mention a key
+void config_set_defaults(AiConfig *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->max_tokens = MAXTOKENS;
+    cfg->temperature = 0;
+    cfg->command_timeout = COMMAND_TIMEOUT;
+    cfg->stream = true;
+    cfg->cache = false;
+    cfg->daemon_workers = DAEMON_WORKERS;
+    cfg->response_cache = false;
+    cfg->cache_ttl = RESPONSE_CACHE_TTL;
+    cfg->cache_size = RESPONSE_CACHE_SIZE;
+    cfg->output_head = OUTPUT_HEAD;
+    cfg->output_tail = OUTPUT_TAIL;
+    cfg->output_reduce = true;
+    cfg->output_budget = OUTPUT_BUDGET;
+    cfg->cmd_batch = false;
+    cfg->cmd_concurrency = CMD_CONCURRENCY;
+    cfg->context_tokens = CONTEXT_TOKENS;
+    cfg->context_recent = CONTEXT_RECENT;
+    cfg->summarize = false;
+    cfg->batch_concurrency = BATCH_CONCURRENCY;
+    cfg->batch_retries = BATCH_RETRIES;
+    cfg->sessions = true;
+    cfg->retries = REQUEST_RETRIES;
+    cfg->hedge_percentile = HEDGE_PERCENTILE;
+    cfg->readonly_ttl = READONLY_TTL;
+    cfg->speculate = false;
+}
+
+void config_free(AiConfig *cfg) {
+    free(cfg->prompt);
+    free(cfg->added_prompt);
+    for (size_t i = 0; i < cfg->backend_count; i++) {
+        Backend *b = &cfg->backends[i];
+        free(b->name);
+        free(b->endpoint);
+        free(b->model);
+        free(b->api_key);
+        free(b->headers);
+        free(b->latency);
+    }
+    free(cfg->backends);
+    free(cfg->backend);
+    free(cfg->cache_dir);
+    free(cfg->readonly);
+    memset(cfg, 0, sizeof(*cfg));
+}
+
+// Function to start a new backend, its settings that are left out are filled in once the whole file is read
+static Backend *config_add_backend(AiConfig *cfg, const char *name, size_t length) {
+    Backend *grown = realloc(cfg->backends, (cfg->backend_count + 1) * sizeof(Backend));
+    if (grown == NULL) return NULL;
+    cfg->backends = grown;
+
+    Backend *b = &cfg->backends[cfg->backend_count];
+    memset(b, 0, sizeof(*b));
+    b->connect_timeout = b->request_timeout = b->gzip_threshold = -1;
+    if ((b->name = strndup(name, length)) == NULL || (b->latency = calloc(1, sizeof(LatencyWindow))) == NULL) {
+        free(b->name);
+        return NULL;
+    }
+    cfg->backend_count++;
+    return b;
+}
+
+// Function to find a backend by name
+const Backend *config_backend(const AiConfig *cfg, const char *name) {
+    for (size_t i = 0; i < cfg->backend_count; i++) {
+        if (strcmp(cfg->backends[i].name, name) == 0) return &cfg->backends[i];
+    }
+    return NULL;
+}
+
+// Function to parse API=, the protocol a backend speaks, -1 when it is none we know
+static int config_parse_api(const char *value, size_t length) {
+    for (size_t i = 0; i < sizeof(backend_api_names) / sizeof(backend_api_names[0]); i++) {
+        if (strlen(backend_api_names[i]) == length && strncasecmp(value, backend_api_names[i], length) == 0) return i;
+    }
+    return -1;
+}
+
+// Function to parse a yes/no style flag
+static bool config_parse_bool(const char *value, size_t length, bool *out) {
+    if ((length == 3 && strncasecmp(value, "yes", 3) == 0) || (length == 4 && strncasecmp(value, "true", 4) == 0) ||
+        (length == 1 && value[0] == '1')) {
+        *out = true;
+        return true;
+    }
+    if ((length == 2 && strncasecmp(value, "no", 2) == 0) || (length == 5 && strncasecmp(value, "false", 5) == 0) ||
+        (length == 1 && value[0] == '0')) {
+        *out = false;
+        return true;
+    }
+    return false;
+}
+
+// Function to parse a number, the value is not NUL terminated inside the mapped file
+static bool config_parse_number(const char *value, size_t length, double *out) {
+    char number[64];
+    if (length == 0 || length >= sizeof(number)) return false;
+    memcpy(number, value, length);
+    number[length] = '\0';
+
+    char *end;
+    errno = 0;
+    *out = strtod(number, &end);
+    // strtod also takes "inf" and "nan", neither fits a JSON body or a cast to long
+    return errno == 0 && *end == '\0' && isfinite(*out) && *out >= 0;
+}
+
+// Function to append one PROMPT= style line to a joined value, lines are separated by a space
+static bool config_append_line(ByteBuffer *joined, const char *value, size_t length) {
+    if (joined->length > 0 && !buffer_append(joined, " ", 1)) return false;
+    return buffer_append(joined, value, length);
+}
+
+// Function to tokenize the whole config in one pass over the mapped file
+static bool config_parse(AiConfig *cfg, const char *data, size_t size) {
+    ByteBuffer prompt = {0}, added_prompt = {0}, headers = {0}, readonly = {0};
+    const char *end = data + size;
+    bool ok = config_add_backend(cfg, "default", strlen("default")) != NULL;
+
+    for (const char *line = data; ok && line < end; ) {
+        const char *line_end = memchr(line, '\n', end - line);
+        if (line_end == NULL) line_end = end;
+        const char *next = line_end < end ? line_end + 1 : end;
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+
+        // [name] starts a backend block, the keys up to the next one set it up
+        if (line_end - line > 2 && line[0] == '[' && line_end[-1] == ']') {
+            Backend *b = &cfg->backends[cfg->backend_count - 1];
+            if (headers.length > 0) b->headers = headers.data;
+            memset(&headers, 0, sizeof(headers));
+            ok = config_add_backend(cfg, line + 1, line_end - line - 2) != NULL;
+            line = next;
+            continue;
+        }
+
+        const char *eq = memchr(line, '=', line_end - line);
+        if (eq == NULL) {
+            line = next;
+            continue;
+        }
+
+        size_t key_len = eq - line;
+        const char *value = eq + 1;
+        size_t value_len = line_end - value;
+        double number;
+        bool flag;
+        int api;
+        Backend *b = &cfg->backends[cfg->backend_count - 1];
+
+#define KEY_IS(name) (key_len == strlen(name) && memcmp(line, name, key_len) == 0)
+        if (KEY_IS("OPENAIKEY") || KEY_IS("APIKEY")) {
+            if (b->api_key == NULL) ok = (b->api_key = strndup(value, value_len)) != NULL;
+        } else if (KEY_IS("MODEL")) {
+            free(b->model);
+            ok = (b->model = strndup(value, value_len)) != NULL;
+        } else if (KEY_IS("ENDPOINT")) {
+            free(b->endpoint);
+            ok = (b->endpoint = strndup(value, value_len)) != NULL;
+        } else if (KEY_IS("HEADER")) {
+            ok = (headers.length == 0 || buffer_append(&headers, "\n", 1)) && buffer_append(&headers, value, value_len);
+        } else if (KEY_IS("API") && (api = config_parse_api(value, value_len)) >= 0) {
+            b->api = api;
+        } else if (KEY_IS("CONNECTTIMEOUT") && config_parse_number(value, value_len, &number)) {
+            b->connect_timeout = (long)number;
+        } else if (KEY_IS("REQUESTTIMEOUT") && config_parse_number(value, value_len, &number)) {
+            b->request_timeout = (long)number;
+        } else if (KEY_IS("GZIPTHRESHOLD") && config_parse_number(value, value_len, &number)) {
+            b->gzip_threshold = (long)number;
+        } else if (cfg->backend_count > 1 && !KEY_IS("API") && !KEY_IS("CONNECTTIMEOUT") &&
+                   !KEY_IS("REQUESTTIMEOUT") && !KEY_IS("GZIPTHRESHOLD")) {
+            fprintf(stderr, "%.*s is not a backend setting, ignored in [%s]\n", (int)key_len, line, b->name);
+        } else if (KEY_IS("BACKEND")) {
+            free(cfg->backend);
+            ok = (cfg->backend = strndup(value, value_len)) != NULL;
+        } else if (KEY_IS("PROMPT")) {
+            ok = config_append_line(&prompt, value, value_len);
+        } else if (KEY_IS("ADDEDPROMPT")) {
+            ok = config_append_line(&added_prompt, value, value_len);
+        } else if (KEY_IS("EXECMODE") && value_len == 10 && strncasecmp(value, "persistent", 10) == 0) {
+            cfg->exec_persistent = true;
+        } else if (KEY_IS("EXECMODE") && value_len == 5 && strncasecmp(value, "spawn", 5) == 0) {
+            cfg->exec_persistent = false;
+        } else if (KEY_IS("CACHEDIR")) {
+            free(cfg->cache_dir);
+            ok = (cfg->cache_dir = strndup(value, value_len)) != NULL;
+        } else if (KEY_IS("MAXTOKENS") && config_parse_number(value, value_len, &number)) {
+            cfg->max_tokens = (long)number;
+        } else if (KEY_IS("TEMPERATURE") && config_parse_number(value, value_len, &number)) {
+            cfg->temperature = number;
+        } else if (KEY_IS("COMMANDTIMEOUT") && config_parse_number(value, value_len, &number)) {
+            cfg->command_timeout = number;
+        } else if (KEY_IS("DAEMONWORKERS") && config_parse_number(value, value_len, &number) && number >= 1) {
+            cfg->daemon_workers = (long)number;
+        } else if (KEY_IS("STREAM") && config_parse_bool(value, value_len, &flag)) {
+            cfg->stream = flag;
+        } else if (KEY_IS("CONFIGCACHE") && config_parse_bool(value, value_len, &flag)) {
+            cfg->cache = flag;
+        } else if (KEY_IS("CACHE") && config_parse_bool(value, value_len, &flag)) {
+            cfg->response_cache = flag;
+        } else if (KEY_IS("CACHETTL") && config_parse_number(value, value_len, &number) && number >= 0) {
+            cfg->cache_ttl = (long)number;
+        } else if (KEY_IS("CACHESIZE") && config_parse_number(value, value_len, &number) && number >= 4096) {
+            cfg->cache_size = (long)number;
+        } else if (KEY_IS("OUTPUTHEAD") && config_parse_number(value, value_len, &number) && number >= 0) {
+            cfg->output_head = (long)number;
+        } else if (KEY_IS("OUTPUTTAIL") && config_parse_number(value, value_len, &number) && number >= 0) {
+            cfg->output_tail = (long)number;
+        } else if (KEY_IS("OUTPUTREDUCE") && config_parse_bool(value, value_len, &flag)) {
+            cfg->output_reduce = flag;
+        } else if (KEY_IS("OUTPUTBUDGET") && config_parse_number(value, value_len, &number) && number >= 0) {
+            cfg->output_budget = (long)number;
+        } else if (KEY_IS("CMDBATCH") && config_parse_bool(value, value_len, &flag)) {
+            cfg->cmd_batch = flag;
+        } else if (KEY_IS("CMDCONCURRENCY") && config_parse_number(value, value_len, &number) && number >= 1) {
+            cfg->cmd_concurrency = (long)number;
+        } else if (KEY_IS("CONTEXTTOKENS") && config_parse_number(value, value_len, &number)) {
+            cfg->context_tokens = (long)number;
+        } else if (KEY_IS("CONTEXTRECENT") && config_parse_number(value, value_len, &number) && number >= 1) {
+            cfg->context_recent = (long)number;
+        } else if (KEY_IS("SUMMARIZE") && config_parse_bool(value, value_len, &flag)) {
+            cfg->summarize = flag;
+        } else if (KEY_IS("BATCHCONCURRENCY") && config_parse_number(value, value_len, &number) && number >= 1) {
+            cfg->batch_concurrency = (long)number;
+        } else if (KEY_IS("BATCHRETRIES") && config_parse_number(value, value_len, &number)) {
+            cfg->batch_retries = (long)number;
+        } else if (KEY_IS("SESSIONS") && config_parse_bool(value, value_len, &flag)) {
+            cfg->sessions = flag;
+        } else if (KEY_IS("RETRIES") && config_parse_number(value, value_len, &number)) {
+            cfg->retries = (long)number;
+        } else if (KEY_IS("HEDGEPERCENTILE") && config_parse_number(value, value_len, &number) && number < 100) {
+            cfg->hedge_percentile = number;
+        } else if (KEY_IS("READONLY")) {
+            ok = (readonly.length == 0 || buffer_append(&readonly, "\n", 1)) && buffer_append(&readonly, value, value_len);
+        } else if (KEY_IS("READONLYTTL") && config_parse_number(value, value_len, &number)) {
+            cfg->readonly_ttl = (long)number;
+        } else if (KEY_IS("SPECULATE") && config_parse_bool(value, value_len, &flag)) {
+            cfg->speculate = flag;
+        } else if (KEY_IS("MAXTOKENS") || KEY_IS("TEMPERATURE") || KEY_IS("CONNECTTIMEOUT") ||
+                   KEY_IS("REQUESTTIMEOUT") || KEY_IS("COMMANDTIMEOUT") || KEY_IS("GZIPTHRESHOLD") ||
+                   KEY_IS("STREAM") || KEY_IS("CONFIGCACHE") || KEY_IS("DAEMONWORKERS") ||
+                   KEY_IS("CACHE") || KEY_IS("CACHETTL") || KEY_IS("CACHESIZE") ||
+                   KEY_IS("OUTPUTHEAD") || KEY_IS("OUTPUTTAIL") || KEY_IS("OUTPUTREDUCE") ||
+                   KEY_IS("OUTPUTBUDGET") || KEY_IS("EXECMODE") ||
+                   KEY_IS("CMDBATCH") || KEY_IS("CMDCONCURRENCY") || KEY_IS("CONTEXTTOKENS") ||
+                   KEY_IS("CONTEXTRECENT") || KEY_IS("SUMMARIZE") || KEY_IS("BATCHCONCURRENCY") ||
+                   KEY_IS("BATCHRETRIES") || KEY_IS("SESSIONS") || KEY_IS("API") ||
+                   KEY_IS("RETRIES") || KEY_IS("HEDGEPERCENTILE") || KEY_IS("READONLYTTL") ||
+                   KEY_IS("SPECULATE")) {
+            fprintf(stderr, "Invalid value for %.*s in config file, using the default\n", (int)key_len, line);
+        }
+#undef KEY_IS
+
+        line = next;
+    }
+
+    if (ok && headers.length > 0) cfg->backends[cfg->backend_count - 1].headers = headers.data;
+    else buffer_free(&headers);
+    if (!ok) {
+        perror("Failed to allocate memory for configuration value");
+        buffer_free(&readonly);
+        buffer_free(&prompt);
+        buffer_free(&added_prompt);
+        return false;
+    }
+
+    cfg->prompt = prompt.data;
+    cfg->added_prompt = added_prompt.data;
+    cfg->readonly = readonly.data;
+    if (cfg->cache_dir == NULL) cfg->cache_dir = strdup(RESPONSE_CACHE_DIR);
+    ok = cfg->cache_dir != NULL;
+
+    // Blocks take the timeouts and the model of the top of the file, but never its compression
+    Backend *top = &cfg->backends[0];
+    if (top->connect_timeout < 0) top->connect_timeout = CONNECT_TIMEOUT;
+    if (top->request_timeout < 0) top->request_timeout = REQUEST_TIMEOUT;
+    if (top->gzip_threshold < 0) top->gzip_threshold = GZIP_REQUEST_THRESHOLD;
+    if (top->model == NULL) ok = ok && (top->model = strdup(DEFAULT_MODEL)) != NULL;
+    for (size_t i = 0; ok && i < cfg->backend_count; i++) {
+        Backend *b = &cfg->backends[i];
+        if (b->connect_timeout < 0) b->connect_timeout = top->connect_timeout;
+        if (b->request_timeout < 0) b->request_timeout = top->request_timeout;
+        if (b->gzip_threshold < 0) b->gzip_threshold = 0;
+        if (b->model == NULL) ok = (b->model = strdup(top->model)) != NULL;
+        if (b->endpoint == NULL) ok = ok && (b->endpoint = strdup(b->api == API_OLLAMA ? OLLAMA_API_URL : OPENAI_API_URL)) != NULL;
+    }
+
+    if (ok && cfg->backend && config_backend(cfg, cfg->backend) == NULL) {
+        fprintf(stderr, "BACKEND=%s does not match any [%s] block in config file\n", cfg->backend, cfg->backend);
+        return false;
+    }
+    return ok;
+}
+
+// Function to build the per-user cache path, it holds the API key so it never goes in a shared directory
+static bool config_cache_path(char *path, size_t size, bool create_dir) {
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[4096];
+
+    if (cache_home && cache_home[0]) {
+        snprintf(dir, sizeof(dir), "%s/ai", cache_home);
+    } else if (home && home[0]) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        if (create_dir) mkdir(dir, 0700);
+        snprintf(dir, sizeof(dir), "%s/.cache/ai", home);
+    } else {
+        return false;
+    }
+
+    if (create_dir && mkdir(dir, 0700) != 0 && errno != EEXIST) return false;
+    return snprintf(path, size, "%s/config.cache", dir) < (int)size;
+}
+
+static void config_cache_key(ConfigCacheHeader *header, const struct stat *st) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CONFIG_CACHE_MAGIC, sizeof(header->magic));
+    header->dev = st->st_dev;
+    header->ino = st->st_ino;
+    header->size = st->st_size;
+    header->mtime_sec = st->st_mtim.tv_sec;
+    header->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+// Function to read one length-prefixed string from the cache image
+static bool config_cache_string(const char **cursor, const char *end, char **out) {
+    uint32_t length;
+    if (end - *cursor < (ptrdiff_t)sizeof(length)) return false;
+    memcpy(&length, *cursor, sizeof(length));
+    *cursor += sizeof(length);
+
+    if (length == UINT32_MAX) { // absent value
+        *out = NULL;
+        return true;
+    }
+    if (end - *cursor < (ptrdiff_t)length) return false;
+    *out = strndup(*cursor, length);
+    *cursor += length;
+    return *out != NULL;
+}
+
+// Function to load the precompiled config, returns false when missing or built from another file
+static bool config_cache_load(AiConfig *cfg, const struct stat *config_st) {
+    char path[4096];
+    if (!config_cache_path(path, sizeof(path), false)) return false;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st;
+    char image[65536];
+    ssize_t size = -1;
+    if (fstat(fd, &st) == 0 && st.st_uid == getuid() && (st.st_mode & 077) == 0) {
+        size = read(fd, image, sizeof(image));
+    }
+    close(fd);
+    if (size < (ssize_t)sizeof(ConfigCacheHeader)) return false;
 
-// Function to get concatenated configuration values based on a key prefix
-char *get_multiline_config_value(const char *key_prefix) {
-    FILE *config_file = fopen(CONFIG_PATH, "r");
-    if (config_file == NULL) {
+    ConfigCacheHeader expected;
+    config_cache_key(&expected, config_st);
+    if (memcmp(image, &expected, sizeof(expected)) != 0) return false;
+
+    AiConfig cached;
+    config_set_defaults(&cached);
+    const char *cursor = image + sizeof(expected);
+    const char *end = image + size;
+    uint32_t backend_count = 0;
+    bool ok = end - cursor >= (ptrdiff_t)(sizeof(long) * 14 + sizeof(double) * 3 + 9 + sizeof(uint32_t));
+    if (ok) {
+        memcpy(&cached.max_tokens, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.daemon_workers, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.cache_ttl, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.cache_size, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.output_head, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.output_tail, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.output_budget, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.cmd_concurrency, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.context_tokens, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.context_recent, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.batch_concurrency, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.batch_retries, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.retries, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.readonly_ttl, cursor, sizeof(long)); cursor += sizeof(long);
+        memcpy(&cached.temperature, cursor, sizeof(double)); cursor += sizeof(double);
+        memcpy(&cached.command_timeout, cursor, sizeof(double)); cursor += sizeof(double);
+        memcpy(&cached.hedge_percentile, cursor, sizeof(double)); cursor += sizeof(double);
+        cached.stream = *cursor++;
+        cached.cache = *cursor++;
+        cached.response_cache = *cursor++;
+        cached.exec_persistent = *cursor++;
+        cached.cmd_batch = *cursor++;
+        cached.summarize = *cursor++;
+        cached.sessions = *cursor++;
+        cached.output_reduce = *cursor++;
+        cached.speculate = *cursor++;
+        memcpy(&backend_count, cursor, sizeof(uint32_t)); cursor += sizeof(uint32_t);
+    }
+    ok = ok && config_cache_string(&cursor, end, &cached.prompt) &&
+         config_cache_string(&cursor, end, &cached.added_prompt) &&
+         config_cache_string(&cursor, end, &cached.backend) &&
+         config_cache_string(&cursor, end, &cached.cache_dir) &&
+         config_cache_string(&cursor, end, &cached.readonly) &&
+         backend_count > 0 && backend_count <= 256 && cached.cache_dir != NULL;
+
+    for (uint32_t i = 0; ok && i < backend_count; i++) {
+        char *name = NULL;
+        Backend *b = NULL;
+        ok = config_cache_string(&cursor, end, &name) && name != NULL &&
+             (b = config_add_backend(&cached, name, strlen(name))) != NULL &&
+             end - cursor >= (ptrdiff_t)(sizeof(long) * 3 + 1);
+        free(name);
+        if (ok) {
+            memcpy(&b->connect_timeout, cursor, sizeof(long)); cursor += sizeof(long);
+            memcpy(&b->request_timeout, cursor, sizeof(long)); cursor += sizeof(long);
+            memcpy(&b->gzip_threshold, cursor, sizeof(long)); cursor += sizeof(long);
+            b->api = *cursor++;
+        }
+        ok = ok && b->api <= API_OLLAMA && config_cache_string(&cursor, end, &b->endpoint) &&
+             config_cache_string(&cursor, end, &b->model) && config_cache_string(&cursor, end, &b->api_key) &&
+             config_cache_string(&cursor, end, &b->headers) && b->endpoint != NULL && b->model != NULL;
+    }
+    ok = ok && cursor == end;
+
+    if (!ok) {
+        config_free(&cached);
+        return false;
+    }
+    *cfg = cached;
+    return true;
+}
+
+static bool config_cache_put_string(ByteBuffer *image, const char *value) {
+    uint32_t length = value ? (uint32_t)strlen(value) : UINT32_MAX;
+    return buffer_append(image, &length, sizeof(length)) && (value == NULL || buffer_append(image, value, length));
+}
+
+// Function to write the precompiled config, written to a temp file and renamed so readers never see half of it
+static void config_cache_store(const AiConfig *cfg, const struct stat *config_st) {
+    char path[4096], tmp_path[4200];
+    if (!config_cache_path(path, sizeof(path), true)) return;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+
+    ConfigCacheHeader header;
+    config_cache_key(&header, config_st);
+    char flags[9] = { cfg->stream, cfg->cache, cfg->response_cache, cfg->exec_persistent, cfg->cmd_batch,
+                      cfg->summarize, cfg->sessions, cfg->output_reduce, cfg->speculate };
+    uint32_t backend_count = (uint32_t)cfg->backend_count;
+
+    ByteBuffer image = {0};
+    bool ok = buffer_append(&image, &header, sizeof(header)) &&
+              buffer_append(&image, &cfg->max_tokens, sizeof(long)) &&
+              buffer_append(&image, &cfg->daemon_workers, sizeof(long)) &&
+              buffer_append(&image, &cfg->cache_ttl, sizeof(long)) &&
+              buffer_append(&image, &cfg->cache_size, sizeof(long)) &&
+              buffer_append(&image, &cfg->output_head, sizeof(long)) &&
+              buffer_append(&image, &cfg->output_tail, sizeof(long)) &&
+              buffer_append(&image, &cfg->output_budget, sizeof(long)) &&
+              buffer_append(&image, &cfg->cmd_concurrency, sizeof(long)) &&
+              buffer_append(&image, &cfg->context_tokens, sizeof(long)) &&
+              buffer_append(&image, &cfg->context_recent, sizeof(long)) &&
+              buffer_append(&image, &cfg->batch_concurrency, sizeof(long)) &&
+              buffer_append(&image, &cfg->batch_retries, sizeof(long)) &&
+              buffer_append(&image, &cfg->retries, sizeof(long)) &&
+              buffer_append(&image, &cfg->readonly_ttl, sizeof(long)) &&
+              buffer_append(&image, &cfg->temperature, sizeof(double)) &&
+              buffer_append(&image, &cfg->command_timeout, sizeof(double)) &&
+              buffer_append(&image, &cfg->hedge_percentile, sizeof(double)) &&
+              buffer_append(&image, flags, sizeof(flags)) &&
+              buffer_append(&image, &backend_count, sizeof(backend_count)) &&
+              config_cache_put_string(&image, cfg->prompt) &&
+              config_cache_put_string(&image, cfg->added_prompt) &&
+              config_cache_put_string(&image, cfg->backend) &&
+              config_cache_put_string(&image, cfg->cache_dir) &&
+              config_cache_put_string(&image, cfg->readonly);
+    for (size_t i = 0; ok && i < cfg->backend_count; i++) {
+        const Backend *b = &cfg->backends[i];
+        ok = config_cache_put_string(&image, b->name) &&
+             buffer_append(&image, &b->connect_timeout, sizeof(long)) &&
+             buffer_append(&image, &b->request_timeout, sizeof(long)) &&
+             buffer_append(&image, &b->gzip_threshold, sizeof(long)) &&
+             buffer_append(&image, &b->api, 1) &&
+             config_cache_put_string(&image, b->endpoint) &&
+             config_cache_put_string(&image, b->model) &&
+             config_cache_put_string(&image, b->api_key) &&
+             config_cache_put_string(&image, b->headers);
+    }
+
+    // Oversized configs are simply parsed every time
+    if (ok && image.length <= 65536) {
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            ok = write(fd, image.data, image.length) == (ssize_t)image.length;
+            close(fd);
+            if (!ok || rename(tmp_path, path) != 0) unlink(tmp_path);
+        }
+    }
+    buffer_free(&image);
+}
+
+// Function to load ai.conf: the file is mapped once and every key is picked up in a single pass
+bool load_config(const char *path, AiConfig *cfg) {
+    config_set_defaults(cfg);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         perror("Failed to open config file");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to stat config file");
+        close(fd);
+        return false;
+    }
+
+    if (config_cache_load(cfg, &st)) {
+        close(fd);
+        return true;
+    }
+
+    bool ok;
+    if (st.st_size == 0) {
+        ok = config_parse(cfg, "", 0);
+    } else {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Failed to map config file");
+            close(fd);
+            return false;
+        }
+        ok = config_parse(cfg, data, st.st_size);
+        munmap(data, st.st_size);
+    }
+    close(fd);
+
+    if (ok && cfg->cache) config_cache_store(cfg, &st);
+    return ok;
+}
+
+// Function to allocate from the arena, a new block is chained when the current one is full
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        // Oversized records get their own block behind the current one so its free space is not lost
+        bool dedicated = size > ARENA_BLOCK_SIZE / 4;
+        size_t block_size = dedicated ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *new_block = malloc(sizeof(ArenaBlock) + block_size);
+        if (new_block == NULL) {
+            perror("Failed to allocate memory for conversation");
+            return NULL;
+        }
+        new_block->used = 0;
+        new_block->size = block_size;
+
+        if (block != NULL && dedicated) {
+            new_block->next = block->next;
+            block->next = new_block;
+        } else {
+            new_block->next = block;
+            arena->head = new_block;
+        }
+        block = new_block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->bytes_used += size;
+    return ptr;
+}
+
+// Function to release every block of the arena at once
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->bytes_used = 0;
+}
+
+// Function to measure the UTF-8 sequence starting at s, 0 when it is not valid
+// (stray continuation bytes, overlong forms, surrogates or a sequence cut short)
+static size_t utf8_sequence_length(const unsigned char *s, size_t available) {
+    unsigned char c = s[0];
+    size_t n;
+    if (c < 0x80) return 1;
+    if (c >= 0xc2 && c <= 0xdf) n = 2;
+    else if (c >= 0xe0 && c <= 0xef) n = 3;
+    else if (c >= 0xf0 && c <= 0xf4) n = 4;
+    else return 0;
+
+    if (available < n) return 0;
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) return 0;
+    }
+    if ((c == 0xe0 && s[1] < 0xa0) || (c == 0xed && s[1] >= 0xa0) ||
+        (c == 0xf0 && s[1] < 0x90) || (c == 0xf4 && s[1] >= 0x90)) {
+        return 0;
+    }
+    return n;
+}
+
+// Function to count the leading bytes that go into a JSON string as they are, 16 at a time with SSE2
+static size_t json_plain_run(const unsigned char *s, size_t length) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        // Signed compare: control characters and every byte >= 0x80 are below space
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+        int mask = _mm_movemask_epi8(special);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < length && s[i] >= 0x20 && s[i] < 0x80 && s[i] != '"' && s[i] != '\\') i++;
+    return i;
+}
+
+// Function to compute the size of a string once escaped for a JSON string literal
+size_t json_escaped_length(const char *s, size_t length) {
+    const unsigned char *u = (const unsigned char *)s;
+    size_t escaped = 0;
+    size_t i = 0;
+    while (i < length) {
+        size_t run = json_plain_run(u + i, length - i);
+        escaped += run;
+        i += run;
+        if (i == length) break;
+
+        unsigned char c = u[i];
+        if (c >= 0x80) {
+            size_t n = utf8_sequence_length(u + i, length - i);
+            escaped += n ? n : 6; // � for a broken byte
+            i += n ? n : 1;
+        } else {
+            bool short_escape = c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\t' || c == '\b' || c == '\f';
+            escaped += short_escape ? 2 : 6; // \u00XX otherwise
+            i++;
+        }
+    }
+    return escaped;
+}
+
+// Function to write the JSON-escaped form of a string, returns the end of the output.
+// UTF-8 is copied as is, bytes that are not valid UTF-8 (binary output, a cut in the middle
+// of a character) become U+FFFD so the request always stays valid JSON
+char *json_escape(char *dst, const char *s, size_t length) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *u = (const unsigned char *)s;
+    size_t i = 0;
+    while (i < length) {
+        size_t run = json_plain_run(u + i, length - i);
+        memcpy(dst, u + i, run);
+        dst += run;
+        i += run;
+        if (i == length) break;
+
+        unsigned char c = u[i];
+        if (c >= 0x80) {
+            size_t n = utf8_sequence_length(u + i, length - i);
+            if (n) {
+                memcpy(dst, u + i, n);
+                dst += n;
+                i += n;
+            } else {
+                dst = stpcpy(dst, "\\ufffd");
+                i++;
+            }
+            continue;
+        }
+
+        switch (c) {
+            case '"':  *dst++ = '\\'; *dst++ = '"'; break;
+            case '\\': *dst++ = '\\'; *dst++ = '\\'; break;
+            case '\n': *dst++ = '\\'; *dst++ = 'n'; break;
+            case '\r': *dst++ = '\\'; *dst++ = 'r'; break;
+            case '\t': *dst++ = '\\'; *dst++ = 't'; break;
+            case '\b': *dst++ = '\\'; *dst++ = 'b'; break;
+            case '\f': *dst++ = '\\'; *dst++ = 'f'; break;
+            default:
+                memcpy(dst, "\\u00", 4);
+                dst[4] = hex[c >> 4];
+                dst[5] = hex[c & 0xf];
+                dst += 6;
+        }
+        i++;
+    }
+    return dst;
+}
+
+// Function to append the model name as a JSON string
+static bool payload_put_model(ByteBuffer *out, const Backend *backend) {
+    size_t model_length = strlen(backend->model);
+    if (!buffer_append(out, "{\"model\":\"", strlen("{\"model\":\"")) ||
+        !buffer_reserve(out, json_escaped_length(backend->model, model_length))) {
+        return false;
+    }
+    out->length = json_escape(out->data + out->length, backend->model, model_length) - out->data;
+    return true;
+}
+
+static bool openai_payload_header(ByteBuffer *out, const Backend *backend, bool stream, long max_tokens, double temperature) {
+    return payload_put_model(out, backend) &&
+           buffer_printf(out, "\",\"temperature\":%g,\"max_tokens\":%ld,%s\"messages\":[", temperature, max_tokens,
+                         stream ? "\"stream\":true," : "");
+}
+
+static const char *openai_reply_content(struct json_object *reply) {
+    struct json_object *choices, *message, *content;
+    if (json_object_object_get_ex(reply, "choices", &choices) &&
+        json_object_object_get_ex(json_object_array_get_idx(choices, 0), "message", &message) &&
+        json_object_object_get_ex(message, "content", &content)) {
+        const char *text = json_object_get_string(content);
+        return text ? text : "";
+    }
+    return NULL;
+}
+
+// Server-sent events: "data: {chunk}" lines, then "data: [DONE]"
+static const char *openai_stream_delta(const char *line, struct json_object **chunk, bool *done) {
+    if (strncmp(line, "data:", 5) != 0) return NULL; // comments, event names and keep-alives
+    line += 5;
+    while (*line == ' ') line++;
+    if (strcmp(line, "[DONE]") == 0) {
+        *done = true;
         return NULL;
     }
 
-    char *value = NULL;
-    char line[1024];
-    size_t value_len = 0;
+    struct json_object *choices, *delta, *content;
+    *chunk = json_tokener_parse(line);
+    if (*chunk && json_object_object_get_ex(*chunk, "choices", &choices) &&
+        json_object_object_get_ex(json_object_array_get_idx(choices, 0), "delta", &delta) &&
+        json_object_object_get_ex(delta, "content", &content)) {
+        return json_object_get_string(content);
+    }
+    return NULL;
+}
+
+// ollama streams unless told not to, and takes the sampling settings as options
+static bool ollama_payload_header(ByteBuffer *out, const Backend *backend, bool stream, long max_tokens, double temperature) {
+    return payload_put_model(out, backend) &&
+           buffer_printf(out, "\",\"stream\":%s,\"options\":{\"temperature\":%g,\"num_predict\":%ld},\"messages\":[",
+                         stream ? "true" : "false", temperature, max_tokens);
+}
+
+static const char *ollama_reply_content(struct json_object *reply) {
+    struct json_object *message, *content;
+    if (json_object_object_get_ex(reply, "message", &message) &&
+        json_object_object_get_ex(message, "content", &content)) {
+        const char *text = json_object_get_string(content);
+        return text ? text : "";
+    }
+    return NULL;
+}
+
+// One JSON object per line, the last one says "done":true
+static const char *ollama_stream_delta(const char *line, struct json_object **chunk, bool *done) {
+    struct json_object *finished;
+    *chunk = json_tokener_parse(line);
+    if (*chunk == NULL) return NULL;
+    if (json_object_object_get_ex(*chunk, "done", &finished) && json_object_get_boolean(finished)) *done = true;
+    return ollama_reply_content(*chunk);
+}
+
+// How each kind of server wants its requests and sends its replies
+typedef struct {
+    // Function to write the request settings up to the opening of the messages array
+    bool (*payload_header)(ByteBuffer *out, const Backend *backend, bool stream, long max_tokens, double temperature);
+    // Function to find the reply text of a complete response, NULL when it has none
+    const char *(*reply_content)(struct json_object *reply);
+    // Function to find the text of one line of a streamed reply; chunk is for the caller to release
+    const char *(*stream_delta)(const char *line, struct json_object **chunk, bool *done);
+} BackendApi;
+
+static const BackendApi backend_apis[] = {
+    [API_OPENAI] = { openai_payload_header, openai_reply_content, openai_stream_delta },
+    [API_OLLAMA] = { ollama_payload_header, ollama_reply_content, ollama_stream_delta },
+};
+
+// Function to pull the reply text out of a complete response, NULL when there is none
+static char *extract_message_content(const Backend *backend, const char *json_response) {
+    struct json_object *parsed_json = json_response ? json_tokener_parse(json_response) : NULL;
+    const char *content = parsed_json ? backend_apis[backend->api].reply_content(parsed_json) : NULL;
+    char *text = content ? strdup(content) : NULL;
+    if (parsed_json) json_object_put(parsed_json);
+    return text;
+}
+
+// Function to build the headers of a backend's requests, the key only ever lives in memory
+static struct curl_slist *backend_headers(const Backend *backend, bool gzip) {
+    struct curl_slist *headers = curl_slist_append(NULL, "Content-Type: application/json");
+    headers = headers ? curl_slist_append(headers, "Expect:") : NULL;
+    if (headers && backend->api_key) {
+        char *auth_header = NULL;
+        if (asprintf(&auth_header, "Authorization: Bearer %s", backend->api_key) < 0) auth_header = NULL;
+        headers = auth_header ? curl_slist_append(headers, auth_header) : NULL;
+        free(auth_header);
+    }
+    for (const char *line = backend->headers; headers && line && *line; ) {
+        size_t length = strcspn(line, "\n");
+        char *header = strndup(line, length);
+        headers = header ? curl_slist_append(headers, header) : NULL;
+        free(header);
+        line += length + (line[length] == '\n');
+    }
+    if (headers && gzip) headers = curl_slist_append(headers, "Content-Encoding: gzip");
+    return headers;
+}
+
+// Function to estimate how many tokens the model will count for some text, without a tokenizer:
+// a word piece is about four letters, punctuation is a token of its own, spaces ride along
+static uint32_t estimate_tokens(const char *s, size_t length) {
+    uint64_t tokens = 0;
+    size_t word = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = s[i];
+        if (isalnum(c)) {
+            word++;
+            continue;
+        }
+        tokens += (word + 3) / 4;
+        word = 0;
+        if (c >= 0x80) {
+            if ((c & 0xc0) != 0x80) tokens++; // one per UTF-8 character
+        } else if (!isspace(c)) {
+            tokens++;
+        }
+    }
+    tokens += (word + 3) / 4;
+    return tokens > UINT32_MAX ? UINT32_MAX : (uint32_t)tokens;
+}
+
+// Function to build a record in the arena, the content is copied and serialized once
+static ConversationEntry *make_conversation_entry(Arena *arena, ConversationRole role, const char *content, size_t length) {
+    if (length > UINT32_MAX) {
+        printf("Conversation entry too large, dropped.\n");
+        return NULL;
+    }
+
+    // {"role":"<role>","content":"<escaped>"} is laid out right behind the content
+    const char *role_name = conversation_role_names[role];
+    size_t json_length = strlen("{\"role\":\"\",\"content\":\"\"}") + strlen(role_name) +
+                         json_escaped_length(content, length);
+    if (json_length > UINT32_MAX) {
+        printf("Conversation entry too large, dropped.\n");
+        return NULL;
+    }
+
+    ConversationEntry *entry = arena_alloc(arena, sizeof(ConversationEntry) + length + 1 + json_length);
+    if (entry == NULL) return NULL;
+
+    entry->role = role;
+    entry->length = (uint32_t)length;
+    entry->stub = NULL;
+    memcpy(entry->content, content, length);
+    entry->content[length] = '\0';
+
+    char *json = entry->content + length + 1;
+    char *p = json;
+    p = stpcpy(p, "{\"role\":\"");
+    p = stpcpy(p, role_name);
+    p = stpcpy(p, "\",\"content\":\"");
+    p = json_escape(p, content, length);
+    memcpy(p, "\"}", 2);
+    entry->json = json;
+    entry->json_length = (uint32_t)json_length;
+    entry->tokens = estimate_tokens(json, json_length);
+    return entry;
+}
+
+// Function to store a record in the log
+static void store_conversation_entry(ConversationLog *log, ConversationEntry *entry) {
+    if (log->count == log->capacity) {
+        size_t new_capacity = log->capacity ? log->capacity * 2 : 64;
+        ConversationEntry **new_entries = realloc(log->entries, new_capacity * sizeof(*new_entries));
+        if (new_entries == NULL) {
+            perror("Failed to grow conversation log");
+            return;
+        }
+        log->entries = new_entries;
+        log->capacity = new_capacity;
+    }
+    log->entries[log->count++] = entry;
+}
+
+// Function to build a record in the session's arena, the content is kept as raw UTF-8
+static ConversationEntry *new_conversation_entry(Session *s, ConversationRole role, const char *content) {
+    return make_conversation_entry(&s->conversation.arena, role, content, strlen(content));
+}
+
+// Function to shrink command results to what the model needs to remember once they are old:
+// the command, its status and how much output there was. NULL when it would not save much
+static char *command_result_stub(const char *content) {
+    static const char marker[] = "command executed: <";
+    if (strncmp(content, marker, strlen(marker)) != 0) return NULL;
+
+    ByteBuffer stub = {0};
+    size_t content_length = strlen(content);
+    for (const char *block = content; block && *block; ) {
+        const char *next = strstr(block + 1, "\n\ncommand executed: <");
+        size_t block_length = next ? (size_t)(next - block) : strlen(block);
+        const char *output = memmem(block, block_length, " output: <", strlen(" output: <"));
+        size_t keep = output ? (size_t)(output - block) : block_length;
+
+        buffer_append(&stub, block, keep < COMMAND_STUB_MAX ? keep : COMMAND_STUB_MAX);
+        if (keep > COMMAND_STUB_MAX) buffer_append(&stub, "...", 3);
+        if (output) buffer_printf(&stub, " output: <%zu bytes, elided to save context>", block_length - keep);
+        block = next;
+    }
+
+    if (stub.data && stub.length >= content_length / 2) buffer_free(&stub);
+    return stub.data;
+}
+
+// Function to find the directory of saved sessions, $XDG_STATE_HOME/ai or ~/.local/state/ai
+static bool session_dir(char *dir, size_t size, bool create_dir) {
+    const char *state_home = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+
+    if (state_home && state_home[0]) {
+        if (create_dir) mkdir(state_home, 0700);
+        n = snprintf(dir, size, "%s/ai", state_home);
+    } else if (home && home[0]) {
+        if (create_dir) {
+            snprintf(dir, size, "%s/.local", home);
+            mkdir(dir, 0700);
+            snprintf(dir, size, "%s/.local/state", home);
+            mkdir(dir, 0700);
+        }
+        n = snprintf(dir, size, "%s/.local/state/ai", home);
+    } else {
+        return false;
+    }
+
+    if (n < 0 || (size_t)n >= size) return false;
+    return !create_dir || mkdir(dir, 0700) == 0 || errno == EEXIST;
+}
+
+static int64_t wall_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t session_record_crc(const SessionRecord *record, const char *content) {
+    SessionRecord header = *record;
+    header.crc = 0;
+    uLong crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)&header, sizeof(header));
+    return (uint32_t)crc32(crc, (const Bytef *)content, record->length);
+}
+
+// Function to read the record at offset in a mapped session file, false at the end or at a damaged record
+static bool session_read_record(const char *map, size_t size, size_t *offset, SessionRecord *record, const char **content) {
+    if (size - *offset < sizeof(SessionRecord)) return false;
+    memcpy(record, map + *offset, sizeof(SessionRecord)); // records are not aligned
+    if (record->role > ROLE_ASSISTANT || size - *offset - sizeof(SessionRecord) < record->length) return false;
+
+    *content = map + *offset + sizeof(SessionRecord);
+    if (session_record_crc(record, *content) != record->crc) return false;
+    *offset += sizeof(SessionRecord) + record->length;
+    return true;
+}
+
+// Function to create the file of a new session, named after its start time so the names sort by age
+static bool session_log_create(SessionLog *log) {
+    char dir[4096], path[4200], date[16];
+    if (!session_dir(dir, sizeof(dir), true)) return false;
+
+    time_t now = time(NULL);
+    struct tm tm;
+    uint16_t suffix = 0;
+    localtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &tm);
+    if (getrandom(&suffix, sizeof(suffix), GRND_NONBLOCK) != sizeof(suffix)) suffix = (uint16_t)getpid();
+    snprintf(log->id, sizeof(log->id), "%s-%04x", date, suffix);
+    snprintf(path, sizeof(path), "%s/%s.log", dir, log->id);
+
+    log->fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+    if (log->fd < 0) return false;
+
+    SessionFileHeader header = { .created = wall_clock_ms() };
+    memcpy(header.magic, SESSION_LOG_MAGIC, sizeof(header.magic));
+    if (write(log->fd, &header, sizeof(header)) != sizeof(header)) {
+        close(log->fd);
+        unlink(path);
+        return false;
+    }
+    log->open = true;
+    return true;
+}
+
+// Function to append a message to the session file, one write per record so a crash tears at most the last one
+static void session_log_append(Session *s, const ConversationEntry *entry, uint8_t flags) {
+    SessionLog *log = &s->log;
+    if (!config.sessions || log->failed) return;
+    if (!log->open && !session_log_create(log)) {
+        fprintf(s->err, "Session not saved: %s\n", strerror(errno));
+        log->failed = true;
+        return;
+    }
+
+    SessionRecord record = { .timestamp = wall_clock_ms(), .length = entry->length, .role = entry->role, .flags = flags };
+    record.crc = session_record_crc(&record, entry->content);
+    struct iovec iov[2] = { { &record, sizeof(record) }, { (void *)entry->content, entry->length } };
+    ssize_t n = writev(log->fd, iov, 2);
+    if (n != (ssize_t)(sizeof(record) + entry->length)) {
+        fprintf(s->err, "Session not saved: %s\n", n < 0 ? strerror(errno) : "short write");
+        log->failed = true;
+        return;
+    }
+    log->dirty = true;
+}
+
+// Function to flush the session file to disk, once per turn rather than once per message
+static void session_log_sync(Session *s) {
+    if (s->log.open && s->log.dirty) {
+        fdatasync(s->log.fd);
+        s->log.dirty = false;
+    }
+}
+
+// Function to find a saved session: an exact ID, a unique prefix of one, or "last" for the newest
+static bool session_find(const char *id, char *path, size_t size, char *found_id, size_t found_size) {
+    char dir[4096];
+    if (!session_dir(dir, sizeof(dir), false)) return false;
+    DIR *d = opendir(dir);
+    if (d == NULL) return false;
+
+    bool newest = strcmp(id, "last") == 0;
+    size_t id_length = strlen(id);
+    int matches = 0;
+    time_t best_mtime = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        size_t name_length = strlen(de->d_name);
+        if (name_length < 5 || strcmp(de->d_name + name_length - 4, ".log") != 0) continue;
+
+        char candidate[4400];
+        snprintf(candidate, sizeof(candidate), "%s/%s", dir, de->d_name);
+        bool exact = name_length - 4 == id_length && strncmp(de->d_name, id, id_length) == 0;
+        struct stat st;
+        if (newest) {
+            if (stat(candidate, &st) != 0 || (matches > 0 && st.st_mtime < best_mtime)) continue;
+            best_mtime = st.st_mtime;
+            matches = 1;
+        } else if (exact) {
+            matches = 1;
+        } else if (strncmp(de->d_name, id, id_length) == 0) {
+            matches++;
+            if (matches > 1) continue;
+        } else {
+            continue;
+        }
+        snprintf(path, size, "%s", candidate);
+        snprintf(found_id, found_size, "%.*s", (int)(name_length - 4), de->d_name);
+        if (exact) break;
+    }
+    closedir(d);
+    return matches == 1;
+}
+
+// Function to load a saved session: the file is mapped and every valid record becomes an entry again,
+// a tail torn by a crash is cut off and the new messages are appended after the last good record
+bool session_resume(Session *s, const char *id) {
+    char path[4400];
+    if (!session_find(id, path, sizeof(path), s->log.id, sizeof(s->log.id))) {
+        fprintf(s->err, "No saved session matches %s, see ai --list\n", id);
+        return false;
+    }
+
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SessionFileHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map == MAP_FAILED || memcmp(map, SESSION_LOG_MAGIC, sizeof(((SessionFileHeader *)0)->magic)) != 0) {
+        fprintf(s->err, "Cannot read session %s\n", s->log.id);
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+
+    size_t offset = sizeof(SessionFileHeader);
+    SessionRecord record;
+    const char *content;
+    ConversationEntry *previous = NULL;
+    while (session_read_record(map, st.st_size, &offset, &record, &content)) {
+        ConversationEntry *entry = make_conversation_entry(&s->conversation.arena, record.role, content, record.length);
+        if (entry == NULL) break;
+        if (record.flags & SESSION_RECORD_STUB) {
+            if (previous) previous->stub = entry;
+        } else {
+            store_conversation_entry(&s->conversation, entry);
+            previous = entry;
+        }
+    }
+    munmap(map, st.st_size);
+
+    if (offset < (size_t)st.st_size) {
+        fprintf(s->err, "Session %s had a damaged end, it was cut off\n", s->log.id);
+        if (ftruncate(fd, offset) != 0) perror("Failed to repair session file");
+    }
+    s->log.fd = fd;
+    s->log.open = true;
+    return true;
+}
+
+// --list and --prune, only main uses them
+#ifndef AI_NO_MAIN
+
+// What --list and --prune need of a session file, read from the record headers only
+typedef struct {
+    long messages;
+    int64_t created;
+    int64_t last_used;
+    char first_request[64];
+} SessionInfo;
+
+static bool session_info(const char *path, SessionInfo *info) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    SessionFileHeader header;
+    struct stat st;
+    memset(info, 0, sizeof(*info));
+    bool ok = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+              memcmp(header.magic, SESSION_LOG_MAGIC, sizeof(header.magic)) == 0;
+    info->created = info->last_used = ok ? header.created : 0;
+
+    // Hop from header to header, only the start of the first request is read for the listing
+    SessionRecord record;
+    for (off_t offset = sizeof(header); ok && pread(fd, &record, sizeof(record), offset) == sizeof(record); ) {
+        off_t next = offset + sizeof(record) + record.length;
+        if (record.role > ROLE_ASSISTANT || next > st.st_size) break;
+        if (!(record.flags & SESSION_RECORD_STUB)) info->messages++;
+        info->last_used = record.timestamp;
+
+        if (record.role == ROLE_USER && info->first_request[0] == '\0') {
+            char *text = info->first_request;
+            size_t want = record.length < sizeof(info->first_request) - 1 ? record.length : sizeof(info->first_request) - 1;
+            ssize_t n = pread(fd, text, want, offset + sizeof(record));
+            size_t end = n > 0 ? (size_t)n : 0;
+
+            // Don't leave half a character at the cut
+            size_t lead = end;
+            while (lead > 0 && ((unsigned char)text[lead - 1] & 0xc0) == 0x80) lead--;
+            if (lead > 0 && (unsigned char)text[lead - 1] >= 0xc0 &&
+                utf8_sequence_length((const unsigned char *)text + lead - 1, end - lead + 1) == 0) {
+                end = lead - 1;
+            }
+            text[end] = '\0';
+            for (char *c = text; *c; c++) {
+                if (*c == '\n' || *c == '\t' || *c == '\r') *c = ' ';
+            }
+        }
+        offset = next;
+    }
+    close(fd);
+    return ok;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Function to walk the saved sessions, oldest first; prune_before > 0 deletes the ones last used before it
+static int walk_sessions(int64_t prune_before) {
+    char dir[4096];
+    DIR *d = session_dir(dir, sizeof(dir), false) ? opendir(dir) : NULL;
+    if (d == NULL) {
+        printf("No saved sessions.\n");
+        return 0;
+    }
+
+    char **names = NULL;
+    size_t count = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        size_t name_length = strlen(de->d_name);
+        if (name_length < 5 || strcmp(de->d_name + name_length - 4, ".log") != 0) continue;
+        char **grown = realloc(names, (count + 1) * sizeof(char *));
+        if (grown == NULL) break;
+        names = grown;
+        if ((names[count] = strdup(de->d_name)) != NULL) count++;
+    }
+    closedir(d);
+    qsort(names, count, sizeof(char *), compare_names);
+
+    int removed = 0;
+    if (prune_before == 0) printf("%-22s %8s  %-16s  %s\n", "ID", "MESSAGES", "LAST USED", "FIRST REQUEST");
+    for (size_t i = 0; i < count; i++) {
+        char path[4400], when[32];
+        SessionInfo info;
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        bool ok = session_info(path, &info);
+        names[i][strlen(names[i]) - 4] = '\0';
+
+        if (prune_before > 0) {
+            if (!ok || info.last_used < prune_before) removed += unlink(path) == 0;
+        } else if (ok) {
+            time_t last_used = info.last_used / 1000;
+            struct tm tm;
+            localtime_r(&last_used, &tm);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm);
+            printf("%-22s %8ld  %-16s  %s\n", names[i], info.messages, when, info.first_request);
+        }
+        free(names[i]);
+    }
+    free(names);
+    if (prune_before > 0) printf("Removed %d saved session%s.\n", removed, removed == 1 ? "" : "s");
+    return 0;
+}
+#endif
+
+// Function to add a message to the conversation
+void append_conversation_entry(Session *s, ConversationRole role, const char *content) {
+    ConversationEntry *entry = new_conversation_entry(s, role, content);
+    if (entry == NULL) return;
+
+    // Command results get their stand-in now, while the raw text is at hand
+    char *stub = role == ROLE_USER ? command_result_stub(content) : NULL;
+    if (stub) {
+        entry->stub = new_conversation_entry(s, ROLE_USER, stub);
+        free(stub);
+    }
+    store_conversation_entry(&s->conversation, entry);
+
+    session_log_append(s, entry, 0);
+    if (entry->stub) session_log_append(s, entry->stub, SESSION_RECORD_STUB);
+}
+
+// Function to add a span to the payload, the bytes must stay valid until the request is sent
+static bool payload_add(Payload *payload, const char *data, size_t length) {
+    if (payload->count == payload->capacity) {
+        size_t new_capacity = payload->capacity ? payload->capacity * 2 : 64;
+        PayloadSegment *new_segments = realloc(payload->segments, new_capacity * sizeof(*new_segments));
+        if (new_segments == NULL) {
+            perror("Failed to allocate memory for payload");
+            return false;
+        }
+        payload->segments = new_segments;
+        payload->capacity = new_capacity;
+    }
+    payload->segments[payload->count].data = data;
+    payload->segments[payload->count].length = length;
+    payload->count++;
+    payload->total_length += length;
+    return true;
+}
+
+enum {
+    CONTEXT_FULL,
+    CONTEXT_STUB,       // an old command result, sent as its stub
+    CONTEXT_SUMMARIZED, // covered by the summary
+    CONTEXT_DROPPED
+};
+
+static size_t buffer_write_callback(char *data, size_t size, size_t nmemb, void *userdata) {
+    return buffer_append(userdata, data, size * nmemb) ? size * nmemb : 0;
+}
+
+static int summarizer_progress(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    Summarizer *sum = userdata;
+    return __atomic_load_n(&sum->cancel, __ATOMIC_ACQUIRE);
+}
+
+// Summary call, runs on its own handle so the session's transport stays free for the conversation
+static void *summarizer_thread(void *arg) {
+    Summarizer *sum = arg;
+    const Backend *backend = sum->backend;
+    CURL *curl = curl_easy_init();
+    struct curl_slist *headers = backend_headers(backend, false);
+
+    if (curl && headers) {
+        curl_easy_setopt(curl, CURLOPT_URL, backend->endpoint);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, sum->body.data);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)sum->body.length);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buffer_write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sum->response);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, summarizer_progress);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, sum);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, backend->connect_timeout);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, backend->request_timeout);
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        if (backend->pool) curl_easy_setopt(curl, CURLOPT_SHARE, backend->pool->share);
+
+        long status = 0;
+        if (curl_easy_perform(curl) == CURLE_OK && curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK &&
+            status == 200) {
+            sum->text = extract_message_content(backend, sum->response.data);
+        }
+    }
+
+    curl_slist_free_all(headers);
+    if (curl) curl_easy_cleanup(curl);
+    __atomic_store_n(&sum->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Function to start summarizing the entries before upto, the request body is built here so the thread
+// never reads the log while the session keeps appending to it
+static void summarizer_start(Session *s, size_t upto) {
+    static const char instruction[] =
+        "Summarize the conversation so far for your own later use, in under 200 words. Keep the goal, "
+        "the commands that were run with their outcome, file names, paths, values and anything still open.";
+    Summarizer *sum = &s->summarizer;
+    ByteBuffer *body = &sum->body;
+
+    body->length = 0;
+    sum->response.length = 0;
+    sum->backend = s->backend;
+    bool ok = backend_apis[s->backend->api].payload_header(body, s->backend, false, 400, 0);
+
+    // The previous summary and the raw entries after it, large outputs only as their stubs
+    bool summary_sent = false;
+    for (size_t i = 0; ok && i < upto; i++) {
+        const ConversationEntry *entry = s->conversation.entries[i];
+        if (entry->role == ROLE_SYSTEM) continue;
+        if (s->summary && i < s->summary_upto && s->context_plan[i] == CONTEXT_SUMMARIZED) {
+            if (summary_sent) continue;
+            entry = s->summary;
+            summary_sent = true;
+        } else if (entry->stub && entry->tokens > 2000) {
+            entry = entry->stub;
+        }
+        ok = buffer_append(body, entry->json, entry->json_length) && buffer_append(body, ",", 1);
+    }
+    ok = ok && buffer_printf(body, "{\"role\":\"user\",\"content\":\"%s\"}]}", instruction);
+    if (!ok) return;
+
+    sum->upto = upto;
+    sum->done = false;
+    sum->cancel = false;
+    sum->text = NULL;
+    sum->started = pthread_create(&sum->thread, NULL, summarizer_thread, sum) == 0;
+}
+
+// Function to pick up a finished summary, it replaces the older entries from the next payload on
+static void summarizer_collect(Session *s) {
+    Summarizer *sum = &s->summarizer;
+    if (!sum->started || !__atomic_load_n(&sum->done, __ATOMIC_ACQUIRE)) return;
+
+    pthread_join(sum->thread, NULL);
+    sum->started = false;
+    if (sum->text) {
+        char *content = NULL;
+        if (asprintf(&content, "Summary of the earlier part of this conversation: %s", sum->text) >= 0) {
+            ConversationEntry *summary = new_conversation_entry(s, ROLE_SYSTEM, content);
+            if (summary) {
+                s->summary = summary;
+                s->summary_upto = sum->upto;
+            }
+            free(content);
+        }
+        free(sum->text);
+        sum->text = NULL;
+    }
+}
+
+// Function to stop a summary still in flight and release the summarizer
+void summarizer_cleanup(Summarizer *sum) {
+    if (sum->started) {
+        __atomic_store_n(&sum->cancel, true, __ATOMIC_RELEASE);
+        pthread_join(sum->thread, NULL);
+        sum->started = false;
+    }
+    free(sum->text);
+    buffer_free(&sum->body);
+    buffer_free(&sum->response);
+}
+
+// Function to decide what each entry contributes so the history fits in CONTEXTTOKENS. System prompts,
+// the first request and the last CONTEXTRECENT entries always go in full; older command results shrink
+// to their stub first, then the oldest entries are left out. Returns true when anything was trimmed
+static bool plan_context(Session *s, bool *ok) {
+    ConversationLog *log = &s->conversation;
+    *ok = true;
+    if (log->count > s->context_plan_capacity) {
+        size_t new_capacity = s->context_plan_capacity ? s->context_plan_capacity : 64;
+        while (new_capacity < log->count) new_capacity *= 2;
+        uint8_t *new_plan = realloc(s->context_plan, new_capacity);
+        if (new_plan == NULL) {
+            perror("Failed to allocate memory for payload");
+            *ok = false;
+            return false;
+        }
+        s->context_plan = new_plan;
+        s->context_plan_capacity = new_capacity;
+    }
+
+    size_t recent = (size_t)config.context_recent;
+    size_t window_start = log->count > recent ? log->count - recent : 0;
+    size_t pinned = SIZE_MAX;
+    uint64_t total = s->summary ? s->summary->tokens : 0;
+    for (size_t i = 0; i < log->count; i++) {
+        const ConversationEntry *entry = log->entries[i];
+        if (pinned == SIZE_MAX && entry->role == ROLE_USER) pinned = i;
+
+        bool keep = entry->role == ROLE_SYSTEM || i == pinned || i >= s->summary_upto || s->summary == NULL;
+        s->context_plan[i] = keep ? CONTEXT_FULL : CONTEXT_SUMMARIZED;
+        if (keep) total += entry->tokens;
+    }
+
+    uint64_t budget = (uint64_t)config.context_tokens;
+    if (budget == 0 || total <= budget) return false;
+
+    for (size_t i = 0; i < window_start && total > budget; i++) {
+        const ConversationEntry *entry = log->entries[i];
+        if (s->context_plan[i] == CONTEXT_FULL && entry->stub && i != pinned) {
+            s->context_plan[i] = CONTEXT_STUB;
+            total -= entry->tokens - entry->stub->tokens;
+        }
+    }
+    size_t trimmed_upto = 0;
+    for (size_t i = 0; i < window_start && total > budget; i++) {
+        const ConversationEntry *entry = log->entries[i];
+        if (entry->role == ROLE_SYSTEM || i == pinned || s->context_plan[i] == CONTEXT_SUMMARIZED) continue;
+        total -= s->context_plan[i] == CONTEXT_STUB ? entry->stub->tokens : entry->tokens;
+        s->context_plan[i] = CONTEXT_DROPPED;
+        trimmed_upto = i + 1;
+    }
+    for (size_t i = trimmed_upto; i < window_start; i++) {
+        if (s->context_plan[i] == CONTEXT_STUB) trimmed_upto = i + 1;
+    }
+
+    // Once entries are trimmed they are worth a summary, redone each time the trimmed part grew
+    if (config.summarize && !s->summarizer.started && trimmed_upto > s->summary_upto) {
+        summarizer_start(s, window_start);
+    }
+    return true;
+}
+
+// Function to generate JSON payload from the conversation log
+// The request settings are spliced around the already serialized messages
+const Payload *generate_json_payload(Session *s) {
+    Payload *payload = &s->payload;
+    ByteBuffer *header = &s->payload_header;
+    static const char trailer[] = "]}";
+
+    // The settings do not change during a session, the header is built once
+    if (header->length == 0 &&
+        !backend_apis[s->backend->api].payload_header(header, s->backend, s->stream, config.max_tokens, config.temperature)) {
+        return NULL;
+    }
+
+    bool ok;
+    summarizer_collect(s);
+    plan_context(s, &ok);
+
+    payload->count = 0;
+    payload->total_length = 0;
+    payload->messages = 0;
+    ok = ok && payload_add(payload, header->data, header->length);
+    bool first = true, summary_added = false;
+    for (size_t i = 0; ok && i < s->conversation.count; i++) {
+        const ConversationEntry *entry = s->conversation.entries[i];
+        switch (s->context_plan[i]) {
+            case CONTEXT_DROPPED:
+                continue;
+            case CONTEXT_SUMMARIZED:
+                // The summary goes where the part it covers used to be
+                if (summary_added) continue;
+                entry = s->summary;
+                summary_added = true;
+                break;
+            case CONTEXT_STUB:
+                entry = entry->stub;
+                break;
+        }
+        if (!first) ok = payload_add(payload, ",", 1);
+        if (ok) ok = payload_add(payload, entry->json, entry->json_length);
+        payload->messages++;
+        first = false;
+    }
+    if (ok) ok = payload_add(payload, trailer, strlen(trailer));
+
+    return ok ? payload : NULL;
+}
+
+// Function to write a whole buffer, retrying on short writes
+static bool write_full(int fd, const void *data, size_t length) {
+    const char *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Function to read exactly length bytes, false on EOF or error
+static bool read_full(int fd, void *data, size_t length) {
+    char *p = data;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+
+// Response cache: a mapped open-addressing index plus an append-only data file under CACHEDIR
+static ResponseCache response_cache = { .fd = -1 };
+static pthread_mutex_t response_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to build the path of the current data file, each compaction writes a new generation
+static void response_cache_data_path(char *path, size_t size, uint64_t generation) {
+    snprintf(path, size, "%s/data.%llu", config.cache_dir, (unsigned long long)generation);
+}
+
+// Function to map the index, created on first use; caller holds response_cache_mutex
+static bool response_cache_open(ResponseCache *c) {
+    if (c->header) return true;
+    if (c->failed) return false;
+
+    char path[4096];
+    mkdir(config.cache_dir, 0700);
+    snprintf(path, sizeof(path), "%s/index", config.cache_dir);
+
+    c->map_size = sizeof(CacheIndexHeader) + sizeof(CacheSlot) * RESPONSE_CACHE_SLOTS;
+    c->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (c->fd < 0) {
+        fprintf(stderr, "Response cache disabled, cannot open %s: %s\n", path, strerror(errno));
+        c->failed = true;
+        return false;
+    }
+
+    flock(c->fd, LOCK_EX);
+    struct stat st;
+    bool fresh = fstat(c->fd, &st) != 0 || (size_t)st.st_size != c->map_size;
+    if (fresh && (ftruncate(c->fd, 0) != 0 || ftruncate(c->fd, c->map_size) != 0)) {
+        fprintf(stderr, "Response cache disabled, cannot size %s: %s\n", path, strerror(errno));
+    } else {
+        void *map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+        if (map != MAP_FAILED) {
+            c->header = map;
+            c->slots = (CacheSlot *)(c->header + 1);
+        }
+    }
+
+    // A new, foreign or older-format index starts over empty
+    if (c->header && (fresh || memcmp(c->header->magic, RESPONSE_CACHE_MAGIC, sizeof(c->header->magic)) != 0 ||
+                      c->header->slot_count != RESPONSE_CACHE_SLOTS)) {
+        memset(c->header, 0, c->map_size);
+        memcpy(c->header->magic, RESPONSE_CACHE_MAGIC, sizeof(c->header->magic));
+        c->header->slot_count = RESPONSE_CACHE_SLOTS;
+    }
+    flock(c->fd, LOCK_UN);
+
+    if (c->header == NULL) {
+        close(c->fd);
+        c->fd = -1;
+        c->failed = true;
+    }
+    return c->header != NULL;
+}
+
+// Function to compute the cache key of a request: FNV-1a and crc32 over the endpoint and the payload bytes
+static void response_cache_key(const char *endpoint, const Payload *payload, uint64_t *hash, uint32_t *check) {
+    uint64_t h = 14695981039346656037ULL;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    size_t endpoint_len = strlen(endpoint) + 1; // the NUL keeps endpoint and body apart
+
+    for (size_t i = 0; i <= payload->count; i++) {
+        const unsigned char *p = (const unsigned char *)(i == 0 ? endpoint : payload->segments[i - 1].data);
+        size_t n = i == 0 ? endpoint_len : payload->segments[i - 1].length;
+        for (size_t j = 0; j < n; j++) {
+            h ^= p[j];
+            h *= 1099511628211ULL;
+        }
+        crc = crc32(crc, p, n);
+    }
+    *hash = h;
+    *check = (uint32_t)crc;
+}
+
+// Function to find the slot of a key, free_slot gets the first reusable slot on the probe path
+static CacheSlot *response_cache_find(ResponseCache *c, uint64_t hash, uint32_t check, CacheSlot **free_slot) {
+    uint32_t count = c->header->slot_count;
+    if (free_slot) *free_slot = NULL;
+
+    for (uint32_t i = 0; i < count; i++) {
+        CacheSlot *slot = &c->slots[(hash + i) % count];
+        if (slot->state == CACHE_SLOT_USED && slot->hash == hash && slot->check == check) return slot;
+        if (slot->state != CACHE_SLOT_USED && free_slot && *free_slot == NULL) *free_slot = slot;
+        if (slot->state == CACHE_SLOT_EMPTY) break;
+    }
+    return NULL;
+}
+
+static void response_cache_drop(ResponseCache *c, CacheSlot *slot) {
+    slot->state = CACHE_SLOT_DELETED;
+    c->header->entries--;
+    c->header->deleted++;
+    c->header->live_bytes -= slot->length;
+    c->header->evictions++;
+}
+
+static bool response_cache_expired(const CacheSlot *slot, int64_t now) {
+    return config.cache_ttl > 0 && now - slot->created >= config.cache_ttl;
+}
+
+// Function to look a request up, on a hit the cached response is copied into out
+bool response_cache_lookup(const char *endpoint, const Payload *payload, ByteBuffer *out) {
+    ResponseCache *c = &response_cache;
+    uint64_t hash;
+    uint32_t check;
+    bool hit = false;
+
+    response_cache_key(endpoint, payload, &hash, &check);
+
+    pthread_mutex_lock(&response_cache_mutex);
+    if (!response_cache_open(c)) {
+        pthread_mutex_unlock(&response_cache_mutex);
+        return false;
+    }
+    flock(c->fd, LOCK_EX);
+
+    int64_t now = time(NULL);
+    CacheSlot *slot = response_cache_find(c, hash, check, NULL);
+    if (slot && response_cache_expired(slot, now)) {
+        response_cache_drop(c, slot);
+        slot = NULL;
+    }
+
+    if (slot) {
+        char path[4096];
+        response_cache_data_path(path, sizeof(path), c->header->generation);
+        int data_fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        out->length = 0;
+        if (data_fd >= 0 && buffer_reserve(out, slot->length) &&
+            pread(data_fd, out->data, slot->length, slot->offset) == (ssize_t)slot->length &&
+            (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef *)out->data, slot->length) == slot->crc) {
+            out->length = slot->length;
+            out->data[out->length] = '\0';
+            slot->last_used = now;
+            hit = true;
+        } else {
+            response_cache_drop(c, slot);
+        }
+        if (data_fd >= 0) close(data_fd);
+    }
+
+    if (hit) {
+        c->header->hits++;
+    } else {
+        c->header->misses++;
+    }
+    flock(c->fd, LOCK_UN);
+    pthread_mutex_unlock(&response_cache_mutex);
+    return hit;
+}
+
+static int cache_slot_newer_first(const void *a, const void *b) {
+    const CacheSlot *x = a, *y = b;
+    return (x->last_used < y->last_used) - (x->last_used > y->last_used);
+}
+
+// Function to evict least recently used entries and rewrite the survivors into a new data file
+static bool response_cache_compact(ResponseCache *c, size_t needed) {
+    uint32_t count = c->header->slot_count;
+    CacheSlot *live = malloc(sizeof(CacheSlot) * (c->header->entries + 1));
+    if (live == NULL) return false;
+
+    int64_t now = time(NULL);
+    uint32_t live_count = 0;
+    for (uint32_t i = 0; i < count && live_count <= c->header->entries; i++) {
+        if (c->slots[i].state == CACHE_SLOT_USED && !response_cache_expired(&c->slots[i], now)) {
+            live[live_count++] = c->slots[i];
+        }
+    }
+    qsort(live, live_count, sizeof(CacheSlot), cache_slot_newer_first);
+
+    // Leave a quarter of the size bound and half of the slots free so compactions stay rare
+    uint64_t budget = (uint64_t)config.cache_size / 4 * 3;
+    budget = budget > needed ? budget - needed : 0;
+
+    char old_path[4096], new_path[4096];
+    response_cache_data_path(old_path, sizeof(old_path), c->header->generation);
+    response_cache_data_path(new_path, sizeof(new_path), c->header->generation + 1);
+    int old_fd = open(old_path, O_RDONLY | O_CLOEXEC);
+    int new_fd = open(new_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    ByteBuffer scratch = {0};
+    uint64_t offset = 0;
+    uint32_t kept = 0;
+    bool ok = new_fd >= 0;
+    for (uint32_t i = 0; ok && old_fd >= 0 && i < live_count; i++) {
+        if (offset + live[i].length > budget || kept >= count / 2) break;
+
+        scratch.length = 0;
+        if (!buffer_reserve(&scratch, live[i].length) ||
+            pread(old_fd, scratch.data, live[i].length, live[i].offset) != (ssize_t)live[i].length) {
+            continue; // unreadable entries are simply dropped
+        }
+        ok = write_full(new_fd, scratch.data, live[i].length);
+        live[kept] = live[i];
+        live[kept++].offset = offset;
+        offset += live[i].length;
+    }
+    buffer_free(&scratch);
+    if (old_fd >= 0) close(old_fd);
+    if (new_fd >= 0) close(new_fd);
+
+    if (!ok) {
+        unlink(new_path);
+        free(live);
+        return false;
+    }
+
+    // Switch the index over to the new file
+    memset(c->slots, 0, sizeof(CacheSlot) * count);
+    for (uint32_t i = 0; i < kept; i++) {
+        CacheSlot *slot;
+        response_cache_find(c, live[i].hash, live[i].check, &slot);
+        *slot = live[i];
+    }
+    c->header->evictions += c->header->entries - kept;
+    c->header->entries = kept;
+    c->header->deleted = 0;
+    c->header->live_bytes = offset;
+    c->header->data_size = offset;
+    c->header->generation++;
+    unlink(old_path);
+    free(live);
+    return true;
+}
+
+// Function to remember the response to a request, failures only mean the next call goes to the network
+void response_cache_store(const char *endpoint, const Payload *payload, const char *data, size_t length) {
+    ResponseCache *c = &response_cache;
+    if (length == 0 || length > (size_t)config.cache_size / 4) return;
+
+    uint64_t hash;
+    uint32_t check;
+    response_cache_key(endpoint, payload, &hash, &check);
+
+    pthread_mutex_lock(&response_cache_mutex);
+    if (!response_cache_open(c)) {
+        pthread_mutex_unlock(&response_cache_mutex);
+        return;
+    }
+    flock(c->fd, LOCK_EX);
+
+    bool ok = true;
+    if (c->header->data_size + length > (uint64_t)config.cache_size ||
+        c->header->entries + c->header->deleted >= c->header->slot_count / 4 * 3) {
+        ok = response_cache_compact(c, length);
+    }
+
+    char path[4096];
+    response_cache_data_path(path, sizeof(path), c->header->generation);
+    int data_fd = ok ? open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600) : -1;
+
+    // Data goes in first, the slot only points at it once it is complete
+    if (data_fd >= 0 && pwrite(data_fd, data, length, c->header->data_size) == (ssize_t)length) {
+        CacheSlot *free_slot;
+        CacheSlot *slot = response_cache_find(c, hash, check, &free_slot);
+        if (slot) {
+            c->header->live_bytes -= slot->length;
+        } else if ((slot = free_slot) != NULL) {
+            if (slot->state == CACHE_SLOT_DELETED) c->header->deleted--;
+            c->header->entries++;
+        }
+
+        if (slot) {
+            int64_t now = time(NULL);
+            slot->hash = hash;
+            slot->check = check;
+            slot->state = CACHE_SLOT_USED;
+            slot->offset = c->header->data_size;
+            slot->length = (uint32_t)length;
+            slot->crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef *)data, length);
+            slot->created = now;
+            slot->last_used = now;
+            c->header->data_size += length;
+            c->header->live_bytes += length;
+            c->header->stores++;
+        }
+    }
+    if (data_fd >= 0) close(data_fd);
+
+    flock(c->fd, LOCK_UN);
+    pthread_mutex_unlock(&response_cache_mutex);
+}
+
+// Function to print the cache counters for --cache-stats
+int print_cache_stats(void) {
+    ResponseCache *c = &response_cache;
+    if (!response_cache_open(c)) return 1;
+
+    flock(c->fd, LOCK_SH);
+    CacheIndexHeader h = *c->header;
+    flock(c->fd, LOCK_UN);
+
+    uint64_t lookups = h.hits + h.misses;
+    printf("Response cache: %s (%s)\n", config.cache_dir, config.response_cache ? "enabled" : "disabled in config");
+    printf("Entries: %u of %u slots, %llu bytes live, %llu bytes in data file\n", h.entries, h.slot_count,
+           (unsigned long long)h.live_bytes, (unsigned long long)h.data_size);
+    printf("Hits: %llu Misses: %llu Hit ratio: %.1f%%\n", (unsigned long long)h.hits, (unsigned long long)h.misses,
+           lookups ? 100.0 * h.hits / lookups : 0.0);
+    printf("Stores: %llu Evictions: %llu\n", (unsigned long long)h.stores, (unsigned long long)h.evictions);
+    return 0;
+}
+
+static void curl_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    BackendPool *pool = userptr;
+    pthread_mutex_lock(&pool->locks[data]);
+}
+
+static void curl_share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+    BackendPool *pool = userptr;
+    pthread_mutex_unlock(&pool->locks[data]);
+}
+
+// Function to set up one share handle per backend, DNS, TLS sessions and connections are pooled
+// so a slow remote API never holds up the connections of a local server
+bool transport_share_init(void) {
+    for (size_t b = 0; b < config.backend_count; b++) {
+        BackendPool *pool = calloc(1, sizeof(BackendPool));
+        if (pool == NULL || (pool->share = curl_share_init()) == NULL) {
+            free(pool);
+            return false;
+        }
+
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(&pool->locks[i], NULL);
+        curl_share_setopt(pool->share, CURLSHOPT_LOCKFUNC, curl_share_lock);
+        curl_share_setopt(pool->share, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+        curl_share_setopt(pool->share, CURLSHOPT_USERDATA, pool);
+        curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+        config.backends[b].pool = pool;
+    }
+    return true;
+}
+
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to build the path of a backend's latency samples, named after what is measured: the endpoint and the model
+static bool latency_path(const Backend *backend, char *path, size_t size, bool create_dir) {
+    char dir[4096];
+    uint64_t h = 14695981039346656037ULL;
+    for (const char *p = backend->endpoint; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ '\n') * 1099511628211ULL;
+    for (const char *p = backend->model; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    return session_dir(dir, sizeof(dir), create_dir) &&
+           snprintf(path, size, "%s/latency-%016llx", dir, (unsigned long long)h) < (int)size;
+}
+
+// Function to get the samples of a backend, the caller holds latency_mutex
+static LatencySamples *latency_samples(const Backend *backend) {
+    LatencyWindow *window = backend->latency;
+    if (!window->loaded) {
+        char path[4096];
+        int fd = latency_path(backend, path, sizeof(path), false) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+        LatencySamples *samples = &window->samples;
+        if (fd < 0 || read(fd, samples, sizeof(*samples)) != (ssize_t)sizeof(*samples) ||
+            memcmp(samples->magic, LATENCY_MAGIC, sizeof(samples->magic)) != 0 ||
+            samples->count > LATENCY_WINDOW || samples->next >= LATENCY_WINDOW) {
+            memset(samples, 0, sizeof(*samples));
+            memcpy(samples->magic, LATENCY_MAGIC, sizeof(samples->magic));
+        }
+        if (fd >= 0) close(fd);
+        window->loaded = true;
+    }
+    return &window->samples;
+}
+
+static int compare_uint32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to find after how long a request is slow enough to be hedged, 0 while there are too few samples
+static double latency_hedge_after(const Backend *backend, double percentile) {
+    uint32_t sorted[LATENCY_WINDOW];
+    uint32_t count;
+
+    pthread_mutex_lock(&latency_mutex);
+    LatencySamples *samples = latency_samples(backend);
+    count = samples->count;
+    memcpy(sorted, samples->ms, count * sizeof(uint32_t));
+    pthread_mutex_unlock(&latency_mutex);
+
+    if (count < HEDGE_MIN_SAMPLES) return 0;
+    qsort(sorted, count, sizeof(uint32_t), compare_uint32);
+    uint32_t rank = (uint32_t)(count * percentile / 100.0 + 0.999999);
+    double ms = sorted[rank > 0 ? rank - 1 : 0];
+    return ms > HEDGE_MIN_MS ? ms : HEDGE_MIN_MS;
+}
+
+// Function to add the time to first byte of an answered request, written through so the next run starts with it
+static void latency_record(const Backend *backend, double ms) {
+    char path[4096];
+    pthread_mutex_lock(&latency_mutex);
+    LatencySamples *samples = latency_samples(backend);
+    samples->ms[samples->next] = ms < UINT32_MAX ? (uint32_t)ms : UINT32_MAX;
+    samples->next = (samples->next + 1) % LATENCY_WINDOW;
+    if (samples->count < LATENCY_WINDOW) samples->count++;
+
+    int fd = latency_path(backend, path, sizeof(path), true) ? open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600) : -1;
+    if (fd >= 0) {
+        // A failed write only costs the next run its samples
+        ssize_t written = pwrite(fd, samples, sizeof(*samples), 0);
+        (void)written;
+        close(fd);
+    }
+    pthread_mutex_unlock(&latency_mutex);
+}
+
+// Function to pick how long to wait before a retry: Retry-After when the server gave one,
+// otherwise exponential backoff with jitter; attempt counts from 1
+static double retry_delay_ms(CURL *curl, long attempt) {
+    curl_off_t retry_after = -1;
+    curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after);
+    double delay = RETRY_BACKOFF_MS * (double)(1L << (attempt < 7 ? attempt - 1 : 6));
+    if (delay > RETRY_BACKOFF_MAX_MS) delay = RETRY_BACKOFF_MAX_MS;
+    return retry_after > 0 ? retry_after * 1000.0 : delay / 2 + random() % (long)(delay / 2 + 1);
+}
+
+// Function to handle one line of a streamed reply, content deltas go straight to the terminal
+static void handle_stream_event(Transport *t, char *line) {
+    struct json_object *chunk = NULL;
+    const char *text = backend_apis[t->backend->api].stream_delta(line, &chunk, &t->stream_done);
+
+    if (text) {
+        size_t text_len = strlen(text);
+        size_t before = t->message.length;
+        bool echo = t->command_end == 0;
+
+        if (text_len > 0 && buffer_append(&t->message, text, text_len) && echo) {
+            // Once a full command is in, its approval prompt goes up right away and the rest of the reply
+            // is only collected, it is shown after the answer
+            const char *start_tag = t->on_command ? strstr(t->message.data, "<CMD>") : NULL;
+            if (start_tag) {
+                const char *search_from = t->message.data + (before > 5 ? before - 5 : 0);
+                const char *end_tag = strstr(search_from > start_tag ? search_from : start_tag, "</CMD>");
+                if (end_tag) {
+                    t->command_end = end_tag + strlen("</CMD>") - t->message.data;
+                    text_len = t->command_end - before;
+                }
+            }
+            fwrite(text, 1, text_len, t->out);
+            fflush(t->out);
+        }
+    }
+    if (chunk) json_object_put(chunk);
+}
+
+// Function to collect the response body of one of the handles, the first one to answer is kept
+static size_t transport_receive(Transport *t, CURL *from, char *data, size_t length) {
+    if (t->winner == NULL) t->winner = from;
+    if (t->winner != from || !buffer_append(&t->response, data, length)) return 0;
+
+    // Error bodies are plain JSON, they are only collected
+    long status = 0;
+    curl_easy_getinfo(from, CURLINFO_RESPONSE_CODE, &status);
+    if (!t->streaming || status != 200) return length;
+
+    char *line_end;
+    while ((line_end = memchr(t->response.data + t->sse_offset, '\n', t->response.length - t->sse_offset)) != NULL) {
+        char *line = t->response.data + t->sse_offset;
+        t->sse_offset = line_end + 1 - t->response.data;
+        *line_end = '\0';
+        if (line_end > line && line_end[-1] == '\r') line_end[-1] = '\0';
+        handle_stream_event(t, line);
+    }
+    return length;
+}
+
+// libcurl callbacks collecting the response body of the request and of its hedge
+static size_t transport_write_callback(char *data, size_t size, size_t nmemb, void *userdata) {
+    Transport *t = userdata;
+    return transport_receive(t, t->curl, data, size * nmemb);
+}
+
+static size_t transport_hedge_write_callback(char *data, size_t size, size_t nmemb, void *userdata) {
+    Transport *t = userdata;
+    return transport_receive(t, t->hedge, data, size * nmemb);
+}
+
+// libcurl callback feeding the request body, so the payload never goes through argv
+static size_t transport_read_callback(char *dest, size_t size, size_t nmemb, void *userdata) {
+    Transport *t = userdata;
+    size_t wanted = size * nmemb;
+    size_t copied = 0;
+
+    while (copied < wanted && t->body_segment < t->body->count) {
+        const PayloadSegment *segment = &t->body->segments[t->body_segment];
+        size_t left = segment->length - t->body_offset;
+        size_t n = left < wanted - copied ? left : wanted - copied;
+
+        memcpy(dest + copied, segment->data + t->body_offset, n);
+        copied += n;
+        t->body_offset += n;
+        if (t->body_offset == segment->length) {
+            t->body_segment++;
+            t->body_offset = 0;
+        }
+    }
+    return copied;
+}
+
+// libcurl callback to rewind the body when a request has to be resent on a fresh connection
+static int transport_seek_callback(void *userdata, curl_off_t offset, int origin) {
+    Transport *t = userdata;
+    if (origin != SEEK_SET || offset < 0 || (size_t)offset > t->body->total_length) return CURL_SEEKFUNC_CANTSEEK;
+
+    size_t remaining = (size_t)offset;
+    t->body_segment = 0;
+    while (t->body_segment < t->body->count && remaining >= t->body->segments[t->body_segment].length) {
+        remaining -= t->body->segments[t->body_segment].length;
+        t->body_segment++;
+    }
+    t->body_offset = remaining;
+    return CURL_SEEKFUNC_OK;
+}
+
+// Function to send a duplicate of the request in flight, it gets the body in one piece
+// since it cannot share the read position of the first one
+static bool transport_start_hedge(Transport *t) {
+    const Payload *body = t->body;
+    const char *data = body->count == 1 ? body->segments[0].data : NULL;
+    if (data == NULL) {
+        t->flat.length = 0;
+        for (size_t i = 0; i < body->count; i++) {
+            if (!buffer_append(&t->flat, body->segments[i].data, body->segments[i].length)) return false;
+        }
+        data = t->flat.data;
+    }
+
+    t->hedge = curl_easy_duphandle(t->curl);
+    if (t->hedge == NULL) return false;
+    // A duplicate does not keep the share handle, without it the daemon's pooled connections are not used
+    if (t->backend->pool) curl_easy_setopt(t->hedge, CURLOPT_SHARE, t->backend->pool->share);
+    curl_easy_setopt(t->hedge, CURLOPT_WRITEFUNCTION, transport_hedge_write_callback);
+    curl_easy_setopt(t->hedge, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body->total_length);
+    curl_easy_setopt(t->hedge, CURLOPT_POSTFIELDS, data);
+    if (curl_multi_add_handle(t->multi, t->hedge) != CURLM_OK) {
+        curl_easy_cleanup(t->hedge);
+        t->hedge = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Function to let go of the hedge once its request is over
+static void transport_drop_hedge(Transport *t) {
+    if (t->hedge == NULL) return;
+    if (t->winner == t->hedge) t->winner = NULL;
+    curl_multi_remove_handle(t->multi, t->hedge);
+    curl_easy_cleanup(t->hedge);
+    t->hedge = NULL;
+}
+
+// Drain thread: keeps the transfer going while the main thread waits for the user, until the reply is complete
+static void *transport_drain_thread(void *arg) {
+    Transport *t = arg;
+    int running = 1;
+    while (running) {
+        if (curl_multi_perform(t->multi, &running) != CURLM_OK) break;
+        if (running) curl_multi_poll(t->multi, NULL, 0, 1000, NULL);
+    }
+    return NULL;
+}
+
+// Function to ask about the first command of a reply that is still streaming in. The losing leg of a hedge
+// is dropped so the drain thread stops with the reply, whose rest is shown once the answer is in.
+// Returns the legs left on the multi handle
+static int transport_drain(Transport *t, int legs) {
+    char *reply = strndup(t->message.data, t->command_end);
+    if (reply == NULL) return legs;
+
+    if (t->hedge && t->winner == t->curl) {
+        transport_drop_hedge(t);
+        legs--;
+    } else if (t->hedge) {
+        curl_multi_remove_handle(t->multi, t->curl);
+        legs--;
+    }
+    t->draining = pthread_create(&t->drain_thread, NULL, transport_drain_thread, t) == 0;
+    t->on_command(t->on_command_arg, reply);
+    if (t->draining) pthread_join(t->drain_thread, NULL);
+    t->draining = false;
+    free(reply);
+
+    fwrite(t->message.data + t->command_end, 1, t->message.length - t->command_end, t->out);
+    fflush(t->out);
+    return legs;
+}
+
+// Function to run the request, a hedge goes out when nothing came back after hedge_after_ms (0 never).
+// The handle the reply came from is left in t->winner, the caller drops the hedge when done with it
+static CURLcode transport_perform(Transport *t, double hedge_after_ms) {
+    double started = monotonic_ms();
+    CURLcode result = CURLE_OK;
+    CURL *finished = NULL;
+    int legs = 1;
+
+    t->winner = NULL;
+    if (curl_multi_add_handle(t->multi, t->curl) != CURLM_OK) return CURLE_FAILED_INIT;
+
+    while (finished == NULL) {
+        int running;
+        if (curl_multi_perform(t->multi, &running) != CURLM_OK) {
+            result = CURLE_FAILED_INIT;
+            break;
+        }
+
+        CURLMsg *msg;
+        int queued;
+        while (finished == NULL && (msg = curl_multi_info_read(t->multi, &queued)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            curl_multi_remove_handle(t->multi, msg->easy_handle);
+            legs--;
+            // A handle that failed before answering only counts once the other one cannot answer either
+            if (msg->easy_handle == t->winner || (t->winner == NULL && (msg->data.result == CURLE_OK || legs == 0))) {
+                finished = msg->easy_handle;
+                result = msg->data.result;
+            }
+        }
+        if (finished) break;
+
+        if (t->command_end > 0 && !t->command_asked) {
+            t->command_asked = true;
+            legs = transport_drain(t, legs);
+            continue;
+        }
+
+        long wait_ms = 1000;
+        if (hedge_after_ms > 0 && t->hedge == NULL && t->winner == NULL) {
+            double left = hedge_after_ms - (monotonic_ms() - started);
+            if (left <= 0) {
+                if (transport_start_hedge(t)) legs++;
+                hedge_after_ms = 0;
+            } else if (left < wait_ms) {
+                wait_ms = (long)left + 1;
+            }
+        }
+        curl_multi_poll(t->multi, NULL, 0, wait_ms, NULL);
+    }
+
+    curl_multi_remove_handle(t->multi, t->curl);
+    if (t->winner == NULL) t->winner = finished ? finished : t->curl;
+
+    // A reply that was complete before its command could be asked about is shown whole, it is asked about later
+    if (t->command_end > 0 && !t->command_asked) {
+        fwrite(t->message.data + t->command_end, 1, t->message.length - t->command_end, t->out);
+        fflush(t->out);
+    }
+    return result;
+}
+
+// Function to gzip the payload into the transport's scratch buffer
+static bool gzip_payload(Transport *t, const Payload *payload) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+    t->compressed.length = 0;
+    if (!buffer_reserve(&t->compressed, deflateBound(&zs, payload->total_length))) {
+        deflateEnd(&zs);
+        return false;
+    }
+
+    zs.next_out = (Bytef *)t->compressed.data;
+    zs.avail_out = t->compressed.capacity;
+    int rc = Z_OK;
+    for (size_t i = 0; i <= payload->count && rc == Z_OK; i++) {
+        bool last = i == payload->count;
+        zs.next_in = last ? Z_NULL : (Bytef *)payload->segments[i].data;
+        zs.avail_in = last ? 0 : payload->segments[i].length;
+        rc = deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+    }
+    t->compressed.length = zs.total_out;
+    deflateEnd(&zs);
+
+    return rc == Z_STREAM_END;
+}
+
+// Function to set up the reusable easy handle once per session, for the backend the session talks to
+bool transport_init(Transport *t, const Backend *backend) {
+    t->curl = curl_easy_init();
+    t->multi = curl_multi_init();
+    if (t->curl == NULL || t->multi == NULL) {
+        fprintf(stderr, "Failed to initialize libcurl\n");
+        return false;
+    }
+
+    // The key only ever lives in memory, never on a command line
+    t->backend = backend;
+    t->headers = backend_headers(backend, false);
+    t->gzip_headers = backend_headers(backend, true);
+    if (t->headers == NULL || t->gzip_headers == NULL) {
+        perror("Failed to allocate memory for headers");
+        return false;
+    }
+
+    curl_easy_setopt(t->curl, CURLOPT_URL, backend->endpoint);
+    curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT, backend->connect_timeout);
+    curl_easy_setopt(t->curl, CURLOPT_TIMEOUT, backend->request_timeout);
+    curl_easy_setopt(t->curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_READFUNCTION, transport_read_callback);
+    curl_easy_setopt(t->curl, CURLOPT_READDATA, t);
+    curl_easy_setopt(t->curl, CURLOPT_SEEKFUNCTION, transport_seek_callback);
+    curl_easy_setopt(t->curl, CURLOPT_SEEKDATA, t);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEFUNCTION, transport_write_callback);
+    curl_easy_setopt(t->curl, CURLOPT_WRITEDATA, t);
+    curl_easy_setopt(t->curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(t->curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(t->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL, 1L);
+    if (backend->pool) curl_easy_setopt(t->curl, CURLOPT_SHARE, backend->pool->share);
+    return true;
+}
+
+static size_t transport_discard_callback(char *data, size_t size, size_t nmemb, void *userdata) {
+    return size * nmemb;
+}
+
+// Warm-up thread: runs the HEAD request on the transport's multi handle, the connection it opens
+// (DNS, TCP, TLS and HTTP/2 setup) stays in the pool for the next request
+static void *transport_warm_thread(void *arg) {
+    Transport *t = arg;
+    if (curl_multi_add_handle(t->multi, t->warm) == CURLM_OK) {
+        int running = 1;
+        while (running && !__atomic_load_n(&t->warm_cancel, __ATOMIC_ACQUIRE)) {
+            if (curl_multi_perform(t->multi, &running) != CURLM_OK) break;
+            if (running) curl_multi_poll(t->multi, NULL, 0, 1000, NULL);
+        }
+        curl_multi_remove_handle(t->multi, t->warm);
+    }
+    return NULL;
+}
+
+// Function to open the connection to the backend in the background while the user reads or types,
+// unless a request went out a moment ago and its connection is still warm
+static void transport_warm_up(Session *s) {
+    Transport *t = &s->transport;
+    if (t->warming || t->draining || s->backend == NULL || (t->last_used > 0 && monotonic_ms() - t->last_used < WARMUP_IDLE_MS)) return;
+    if (t->curl == NULL && !transport_init(t, s->backend)) return;
+
+    if (t->warm == NULL) {
+        t->warm = curl_easy_duphandle(t->curl);
+        if (t->warm == NULL) return;
+        if (t->backend->pool) curl_easy_setopt(t->warm, CURLOPT_SHARE, t->backend->pool->share);
+        curl_easy_setopt(t->warm, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(t->warm, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(t->warm, CURLOPT_HTTPHEADER, t->headers);
+        curl_easy_setopt(t->warm, CURLOPT_WRITEFUNCTION, transport_discard_callback);
+    }
+    t->warm_cancel = false;
+    t->warming = pthread_create(&t->warm_thread, NULL, transport_warm_thread, t) == 0;
+}
+
+// Function to take the multi handle back from the warm-up, a handshake in progress is waited for
+// since the request would only have to start it again; cancel drops it instead
+static void transport_warm_join(Transport *t, bool cancel) {
+    if (!t->warming) return;
+    if (cancel) {
+        __atomic_store_n(&t->warm_cancel, true, __ATOMIC_RELEASE);
+        curl_multi_wakeup(t->multi);
+    }
+    pthread_join(t->warm_thread, NULL);
+    t->warming = false;
+}
+
+void transport_cleanup(Transport *t) {
+    transport_warm_join(t, true);
+    if (t->warm) curl_easy_cleanup(t->warm);
+    transport_drop_hedge(t);
+    if (t->curl) curl_easy_cleanup(t->curl);
+    if (t->multi) curl_multi_cleanup(t->multi);
+    buffer_free(&t->flat);
+    curl_slist_free_all(t->headers);
+    curl_slist_free_all(t->gzip_headers);
+    buffer_free(&t->compressed);
+    buffer_free(&t->response);
+    buffer_free(&t->message);
+    memset(t, 0, sizeof(*t));
+}
+
+// Function to turn on --stats and --trace for a session, origin is when its clock started
+void stats_open(Session *s, const Options *opts, double origin) {
+    SessionStats *st = &s->stats;
+    st->print = opts->stats;
+    st->origin = origin;
+
+    if (opts->trace_path) {
+        // The daemon resolves a relative path against the client's directory
+        char path[4096];
+        if (opts->trace_path[0] != '/' && s->cwd) {
+            snprintf(path, sizeof(path), "%s/%s", s->cwd, opts->trace_path);
+        } else {
+            snprintf(path, sizeof(path), "%s", opts->trace_path);
+        }
+        st->trace = fopen(path, "w");
+        if (st->trace == NULL) {
+            fprintf(s->err, "Cannot write trace to %s: %s\n", path, strerror(errno));
+        } else {
+            fputs("[\n", st->trace);
+        }
+    }
+    st->enabled = st->print || st->trace;
+}
+
+// Function to start timing a phase, the clock is not even read when stats are off
+static inline double stats_begin(const Session *s) {
+    return s->stats.enabled ? monotonic_ms() : 0;
+}
+
+// Function to write one complete event to the trace, args is the inside of a JSON object or NULL
+static void stats_trace(Session *s, const char *category, const char *name, double started, double ms, const char *args) {
+    FILE *trace = s->stats.trace;
+    if (trace == NULL) return;
+    fprintf(trace, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":1",
+            name, category, (started - s->stats.origin) * 1000, ms * 1000, (int)getpid());
+    if (args) fprintf(trace, ",\"args\":{%s}", args);
+    fputs("},\n", trace);
+    s->stats.trace_events++;
+}
+
+// Function to close a phase started with stats_begin
+static void stats_end(Session *s, int phase, double started, const char *args) {
+    SessionStats *st = &s->stats;
+    if (!st->enabled) return;
+
+    double ms = monotonic_ms() - started;
+    st->phase_ms[phase] += ms;
+    st->phase_count[phase]++;
+    if (ms > st->phase_max_ms[phase]) st->phase_max_ms[phase] = ms;
+    stats_trace(s, "phase", phase_names[phase], started, ms, args);
+}
+
+// Function to print the --stats summary and close the trace
+void stats_finish(Session *s) {
+    SessionStats *st = &s->stats;
+    if (st->print) {
+        fprintf(s->err, "\n--- ai stats ---\n");
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            if (st->phase_count[i] == 0) continue;
+            fprintf(s->err, "%-8s %10.1f ms in %u call%s (max %.1f ms)\n", phase_names[i], st->phase_ms[i], st->phase_count[i],
+                    st->phase_count[i] == 1 ? "" : "s", st->phase_max_ms[i]);
+        }
+        uint32_t requests = st->phase_count[PHASE_REQUEST] - st->cache_hits;
+        if (requests > 0) fprintf(s->err, "first byte after %.1f ms per request on average\n", st->first_byte_ms / requests);
+        if (st->commands > 0) fprintf(s->err, "%u command%s, %.1f ms waiting for them\n", st->commands,
+                                      st->commands == 1 ? "" : "s", st->child_wait_ms);
+        fprintf(s->err, "payload %llu bytes (largest %llu), sent %llu bytes, received %llu bytes, %u cache hit%s\n",
+                (unsigned long long)st->payload_bytes, (unsigned long long)st->payload_max,
+                (unsigned long long)st->bytes_sent, (unsigned long long)st->bytes_received, st->cache_hits,
+                st->cache_hits == 1 ? "" : "s");
+        fprintf(s->err, "history %zu messages\n", s->conversation.count);
+    }
+    if (st->trace) {
+        // The last event's comma is overwritten when the file allows it, trace viewers accept it either way
+        if (st->trace_events == 0 || fseek(st->trace, -2, SEEK_CUR) != 0) {
+            fputs("]\n", st->trace);
+        } else {
+            fputs("\n]\n", st->trace);
+        }
+        fclose(st->trace);
+        st->trace = NULL;
+    }
+}
+
+// Function to mark the session as finished, replaces exiting the whole program
+void end_session(Session *s, int status) {
+    s->ended = true;
+    s->exit_status = status;
+}
+
+// Function to read one answer from the user, a closed input reads as an empty answer
+bool read_user_line(Session *s, char *buf, size_t size) {
+    fflush(s->out);
+    transport_warm_up(s);
+    double started = stats_begin(s);
+    bool ok = fgets(buf, size, s->in) != NULL;
+    if (!ok) buf[0] = '\0';
+    stats_end(s, PHASE_INPUT, started, NULL);
+    return ok;
+}
+
+// Function to send request to OpenAI API and get response
+char *send_request_to_openai(Session *s) {
+    Transport *transport = &s->transport;
+
+    if (transport->curl == NULL && !transport_init(transport, s->backend)) {
+        return NULL;
+    }
+    transport_warm_join(transport, false);
+
+    session_log_sync(s);
+
+    double started = stats_begin(s);
+    const Payload *json_payload = generate_json_payload(s);
+    if (json_payload == NULL) return NULL;
+    if (s->stats.enabled) {
+        char args[128];
+        snprintf(args, sizeof(args), "\"bytes\":%zu,\"messages\":%zu,\"history\":%zu", json_payload->total_length,
+                 json_payload->messages, s->conversation.count);
+        stats_end(s, PHASE_PAYLOAD, started, args);
+        s->stats.payload_bytes += json_payload->total_length;
+        if (json_payload->total_length > s->stats.payload_max) s->stats.payload_max = json_payload->total_length;
+        started = monotonic_ms();
+    }
+
+    transport->response.length = 0;
+    transport->streaming = s->stream;
+    transport->stream_done = false;
+    transport->message.length = 0;
+    transport->out = s->out;
+
+    // Only deterministic requests are worth replaying, a streamed hit is printed as if it had just arrived
+    bool cacheable = config.response_cache && config.temperature == 0;
+    if (cacheable && response_cache_lookup(s->backend->endpoint, json_payload, s->stream ? &transport->message : &transport->response)) {
+        if (s->stream) {
+            fwrite(transport->message.data, 1, transport->message.length, s->out);
+            transport->stream_done = true;
+        }
+        if (s->stats.enabled) {
+            s->stats.cache_hits++;
+            stats_end(s, PHASE_REQUEST, started, "\"cache\":\"hit\"");
+        }
+        return buffer_append(&transport->response, "", 0) ? transport->response.data : NULL;
+    }
+
+    // Large histories are compressed, small turns are not worth the CPU
+    PayloadSegment compressed_segment;
+    Payload compressed_body = { &compressed_segment, 1, 1, 0, json_payload->messages };
+    long gzip_threshold = s->backend->gzip_threshold;
+    bool compressed = gzip_threshold > 0 && json_payload->total_length >= (size_t)gzip_threshold &&
+                      gzip_payload(transport, json_payload);
+    if (compressed) {
+        compressed_segment.data = transport->compressed.data;
+        compressed_segment.length = compressed_body.total_length = transport->compressed.length;
+        transport->body = &compressed_body;
+    } else {
+        transport->body = json_payload;
+    }
+
+    curl_easy_setopt(transport->curl, CURLOPT_HTTPHEADER, compressed ? transport->gzip_headers : transport->headers);
+    curl_easy_setopt(transport->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)transport->body->total_length);
+
+    // 429s, 5xx and dropped connections are sent again as long as none of the reply is on screen yet
+    double hedge_after = config.hedge_percentile > 0 ? latency_hedge_after(s->backend, config.hedge_percentile) : 0;
+    CURLcode res;
+    long status;
+    long attempt = 0;
+    for (;;) {
+        transport->body_segment = 0;
+        transport->body_offset = 0;
+        transport->response.length = 0;
+        transport->sse_offset = 0;
+        transport->command_end = 0;
+        transport->command_asked = false;
+        res = transport_perform(transport, hedge_after);
+        transport->last_used = monotonic_ms();
+        attempt++;
+
+        status = 0;
+        curl_easy_getinfo(transport->winner, CURLINFO_RESPONSE_CODE, &status);
+        bool failed = res != CURLE_OK || status == 429 || status >= 500;
+        if (!failed || transport->message.length > 0 || attempt > config.retries) break;
+
+        // A Retry-After longer than the longest backoff is not worth waiting for at a prompt
+        double delay = retry_delay_ms(transport->winner, attempt);
+        if (delay > RETRY_BACKOFF_MAX_MS) break;
+        if (res != CURLE_OK) {
+            fprintf(s->err, "Error sending request to %s: %s, retrying in %.1fs\n", s->backend->endpoint,
+                    curl_easy_strerror(res), delay / 1000);
+        } else {
+            fprintf(s->err, "%s answered %ld, retrying in %.1fs\n", s->backend->endpoint, status, delay / 1000);
+        }
+        transport_drop_hedge(transport);
+        usleep((useconds_t)(delay * 1000));
+    }
+    transport->body = NULL;
+
+    curl_off_t first_byte_us = 0;
+    curl_easy_getinfo(transport->winner, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us);
+    if (status == 200) latency_record(s->backend, first_byte_us / 1000.0);
+    if (s->stats.enabled) {
+        curl_off_t sent = 0, received = 0, connect_us = 0, tls_us = 0;
+        curl_easy_getinfo(transport->winner, CURLINFO_SIZE_UPLOAD_T, &sent);
+        curl_easy_getinfo(transport->winner, CURLINFO_SIZE_DOWNLOAD_T, &received);
+        curl_easy_getinfo(transport->winner, CURLINFO_CONNECT_TIME_T, &connect_us);
+        curl_easy_getinfo(transport->winner, CURLINFO_APPCONNECT_TIME_T, &tls_us);
+        s->stats.bytes_sent += sent;
+        s->stats.bytes_received += received;
+        s->stats.first_byte_ms += first_byte_us / 1000.0;
+
+        char args[320];
+        snprintf(args, sizeof(args),
+                 "\"sent\":%lld,\"received\":%lld,\"gzip\":%s,\"status\":%ld,\"connect_us\":%lld,\"tls_us\":%lld,\"first_byte_us\":%lld,"
+                 "\"attempts\":%ld,\"hedged\":%s,\"hedge_won\":%s",
+                 (long long)sent, (long long)received, compressed ? "true" : "false", status, (long long)connect_us,
+                 (long long)tls_us, (long long)first_byte_us, attempt, transport->hedge ? "true" : "false",
+                 transport->hedge && transport->winner == transport->hedge ? "true" : "false");
+        stats_end(s, PHASE_REQUEST, started, args);
+    }
+    transport_drop_hedge(transport);
+
+    if (res != CURLE_OK) {
+        fprintf(s->err, "Error sending request to %s: %s\n", s->backend->endpoint, curl_easy_strerror(res));
+        return NULL;
+    }
+
+    // Error bodies are shown as they came, the conversation itself goes on
+    if (status != 200 && transport->message.length == 0) {
+        fprintf(s->err, "%s answered %ld: %.*s\n", s->backend->endpoint, status, (int)transport->response.length,
+                transport->response.data ? transport->response.data : "");
+        return NULL;
+    }
+
+    if (cacheable && status == 200) {
+        if (!s->stream) {
+            response_cache_store(s->backend->endpoint, json_payload, transport->response.data, transport->response.length);
+        } else if (transport->stream_done) {
+            // Only a reply the server said was complete, a stream that broke off would be replayed short forever
+            response_cache_store(s->backend->endpoint, json_payload, transport->message.data, transport->message.length);
+        }
+    }
+
+    // parse_ai_response expects a string even when the body is empty
+    if (!buffer_append(&transport->response, "", 0)) return NULL;
+
+    return transport->response.data;
+}
+
+// Process the JSON response and extract the "content" field from "choices"
+char *parse_ai_response(Session *s, const char *json_response) {
+    struct json_object *parsed_json;
+
+    // Parse the JSON string
+    parsed_json = json_tokener_parse(json_response);
+    if (parsed_json == NULL) {
+        fprintf(s->out, "%s\n", json_response);
+        fprintf(s->out, "\nAI ended the conversation.\n");
+        end_session(s, 1);
+        return NULL;
+    }
+
+    // Navigate through the JSON structure to reach "content", where it is depends on the backend
+    const char *content_str = backend_apis[s->backend->api].reply_content(parsed_json);
+    if (content_str) {
+        char *result = strdup(content_str);
+        json_object_put(parsed_json);
+        return result;
+    }
+
+    // Clean up if parsing failed
+    json_object_put(parsed_json);
+    fprintf(s->out, "%s\n", json_response);
+    fprintf(s->out, "\nAI ended the conversation.\n");
+    end_session(s, 1);
+
+    return NULL;
+}
+
+// Return the message assembled from the streamed deltas, falls back to the plain parser for error bodies
+char *parse_ai_stream_response(Session *s, const char *raw_response) {
+    if (s->transport.message.length == 0) {
+        return s->transport.stream_done ? strdup("") : parse_ai_response(s, raw_response);
+    }
+    fprintf(s->out, "\n");
+    return strdup(s->transport.message.data);
+}
+
+// If necessary remove these annoying backslashes (not in use right now)
+void remove_extra_backslashes(char *str) {
+    int i, j = 0;
+    int len = strlen(str);
+    char result[len + 1]; // Temporary array to store the modified string
+
+    for (i = 0; i < len; i++) {
+        if (str[i] == '\\' && str[i + 1] == '\\') {
+            // Keep only one backslash
+            result[j++] = '\\';
+            i++; // Skip the next backslash
+        } else if (str[i] == '\\' && (str[i + 1] == '\"' || str[i + 1] == '\'')) {
+            // Remove unnecessary backslashes before quotes
+            result[j++] = str[i + 1];
+            i++; // Skip the next character
+        } else {
+            result[j++] = str[i];
+        }
+    }
+    result[j] = '\0'; // Null-terminate the result string
+    strcpy(str, result); // Copy the result back to the original string
+}
+
+// Function to get a pollable handle on a child, -1 on kernels without pidfd_open
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Function to give the terminal to a process group, SIGTTOU is ignored so a background caller is not stopped
+static void hand_terminal_to(pid_t pgid) {
+    struct sigaction ignore, saved;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGTTOU, &ignore, &saved);
+    tcsetpgrp(STDIN_FILENO, pgid);
+    sigaction(SIGTTOU, &saved, NULL);
+}
+
+// Function to read whatever is available on a capture, straight into the head buffer or the tail ring
+static ssize_t capture_read(OutputCapture *c) {
+    char scratch[4096];
+    ssize_t n;
+
+    if (c->head.length < c->head_limit && buffer_reserve(&c->head, c->head_limit - c->head.length)) {
+        n = read(c->fd, c->head.data + c->head.length, c->head_limit - c->head.length);
+        if (n > 0) c->head.length += n;
+    } else if (c->tail_limit > 0 && (c->tail != NULL || (c->tail = malloc(c->tail_limit)) != NULL)) {
+        // The ring overwrites its oldest bytes once it is full, so memory stays at head + tail
+        size_t write_pos = (c->tail_start + c->tail_length) % c->tail_limit;
+        n = read(c->fd, c->tail + write_pos, c->tail_limit - write_pos);
+        if (n > 0) {
+            size_t overflow = c->tail_length + n > c->tail_limit ? c->tail_length + n - c->tail_limit : 0;
+            c->tail_start = (c->tail_start + overflow) % c->tail_limit;
+            c->tail_length += n - overflow;
+        }
+    } else {
+        n = read(c->fd, scratch, sizeof(scratch)); // no tail kept, the rest is only counted
+    }
+
+    if (n > 0) c->total += n;
+    return n;
+}
+
+// Function to append a capture to the result: head, a marker for what was dropped, then the tail
+static bool capture_render(const OutputCapture *c, ByteBuffer *out) {
+    bool ok = buffer_append(out, c->head.data ? c->head.data : "", c->head.length);
+    uint64_t elided = c->total - c->head.length - c->tail_length;
+    if (ok && elided > 0) ok = buffer_printf(out, "\n[... %llu bytes elided ...]\n", (unsigned long long)elided);
+
+    size_t first = c->tail_limit - c->tail_start < c->tail_length ? c->tail_limit - c->tail_start : c->tail_length;
+    if (ok && c->tail_length > 0) {
+        ok = buffer_append(out, c->tail + c->tail_start, first) &&
+             buffer_append(out, c->tail, c->tail_length - first);
+    }
+    return ok;
+}
+
+static void capture_free(OutputCapture *c) {
+    if (c->fd >= 0) close(c->fd);
+    buffer_free(&c->head);
+    free(c->tail);
+}
+
+// Function to clean one line of command output for the model: ANSI escapes, backspace overstrikes and
+// everything a carriage return wrote over (progress bars) go, as do the other control characters
+static bool output_clean_line(const char *p, const char *end, ByteBuffer *line) {
+    line->length = 0;
+    while (p < end) {
+        // Plain text is copied a run at a time
+        const char *plain = p;
+        while (p < end && ((unsigned char)*p >= 0x20 || *p == '\t')) p++;
+        if (p > plain && !buffer_append(line, plain, p - plain)) return false;
+        if (p == end) break;
+
+        unsigned char c = *p++;
+        if (c == 0x1b && p < end) {
+            if (*p == '[') {
+                // CSI: parameters and intermediates up to the final byte
+                for (p++; p < end && !(*p >= 0x40 && *p <= 0x7e); p++) {}
+                if (p < end) p++;
+            } else if (*p == ']') {
+                // OSC (window titles, hyperlinks): up to BEL or ESC backslash
+                for (p++; p < end && *p != '\a' && !(*p == 0x1b && p + 1 < end && p[1] == '\\'); p++) {}
+                if (p < end) p += *p == '\a' ? 1 : 2;
+            } else {
+                for (; p < end && *p >= 0x20 && *p <= 0x2f; p++) {}
+                if (p < end) p++;
+            }
+        } else if (c == '\r') {
+            if (p < end) line->length = 0;
+        } else if (c == '\b') {
+            if (line->length > 0) line->length--;
+        }
+    }
+    return true;
+}
+
+static bool output_reduce_count(ByteBuffer *out, size_t count, bool same, const ByteBuffer *last) {
+    if (same) return buffer_printf(out, " ×%zu", count);
+    return buffer_printf(out, " ×%zu (numbers differ, the last: ", count) &&
+           buffer_append(out, last->data, last->length) && buffer_append(out, ")", 1);
+}
+
+// Function to reduce one captured output before it goes to the model, the terminal still gets it whole.
+// Runs of lines that are the same once their numbers are left out (timestamps, PIDs, counters) become
+// the first of them with ×N (and the last one when they differ), found by comparing a hash of each line
+// instead of the lines themselves. Past OUTPUTBUDGET bytes the head and the tail are kept and the middle is left out
+static bool output_reduce(const char *text, size_t length, ByteBuffer *out) {
+    ByteBuffer line = {0}, last = {0};
+    size_t start = out->length, run_count = 0;
+    uint64_t run_exact = 0, run_masked = 0;
+    bool run_same = true, run_blank = false, ok = true;
+
+    for (const char *p = text, *end = text + length; ok && p < end; ) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) eol = end;
+        ok = output_clean_line(p, eol, &line);
+        p = eol + 1;
+        if (!ok) break;
+
+        // FNV-1a of the line as is, and of the line with every run of digits counted as one #
+        uint64_t exact = 14695981039346656037ULL, masked = exact;
+        bool digits = false;
+        for (size_t i = 0; i < line.length; i++) {
+            unsigned char c = line.data[i];
+            exact = (exact ^ c) * 1099511628211ULL;
+            if (c >= '0' && c <= '9') {
+                if (!digits) masked = (masked ^ '#') * 1099511628211ULL;
+                digits = true;
+            } else {
+                masked = (masked ^ c) * 1099511628211ULL;
+                digits = false;
+            }
+        }
+
+        if (run_count > 0 && masked == run_masked) {
+            run_count++;
+            run_same = run_same && exact == run_exact;
+            ByteBuffer swap = last;
+            last = line;
+            line = swap;
+            continue;
+        }
+        // The previous run is the last line written so far, it gets its count before the next one.
+        // Blank lines are simply squeezed to one
+        if (run_count > 1 && !run_blank) {
+            ok = output_reduce_count(out, run_count, run_same, &last);
+        }
+        if (ok && run_count > 0) ok = buffer_append(out, "\n", 1);
+        if (ok) ok = buffer_append(out, line.data ? line.data : "", line.length);
+        run_count = 1;
+        run_exact = exact;
+        run_masked = masked;
+        run_same = true;
+        run_blank = line.length == 0;
+    }
+    if (ok && run_count > 1 && !run_blank) ok = output_reduce_count(out, run_count, run_same, &last);
+    buffer_free(&line);
+    buffer_free(&last);
+    if (!ok) return false;
+
+    // Over budget, two thirds go to the head and one to the tail, both cut at line ends when there are any
+    size_t reduced = out->length - start, budget = config.output_budget;
+    if (budget == 0 || reduced <= budget) return buffer_append(out, "", 0);
+
+    char *data = out->data + start;
+    size_t head = budget * 2 / 3, tail = reduced - (budget - head);
+    const char *cut = memrchr(data, '\n', head);
+    if (cut) head = cut - data;
+    cut = memchr(data + tail, '\n', reduced - tail);
+    if (cut && cut + 1 < data + reduced) tail = cut + 1 - data;
+    // Never in the middle of a UTF-8 sequence
+    while (head > 0 && ((unsigned char)data[head] & 0xc0) == 0x80) head--;
+    while (tail < reduced && ((unsigned char)data[tail] & 0xc0) == 0x80) tail++;
+
+    size_t lines = 0;
+    for (const char *q = data + head; (q = memchr(q, '\n', data + tail - q)) != NULL; q++) lines++;
+    char marker[96];
+    int marker_length = snprintf(marker, sizeof(marker), "\n[... %zu lines, %zu bytes elided ...]\n", lines, tail - head);
+    if (marker_length < 0 || (size_t)marker_length > tail - head) return buffer_append(out, "", 0);
+
+    memcpy(data + head, marker, marker_length);
+    memmove(data + head + marker_length, data + tail, reduced - tail);
+    out->length = start + head + marker_length + (reduced - tail);
+    return buffer_append(out, "", 0);
+}
+
+// Function to get a started run ready for supervision: pidfd, non-blocking pipes and its deadline
+static void command_run_begin(CommandRun *run) {
+    run->pidfd = open_pidfd(run->pid);
+    run->deadline = run->timing.started + config.command_timeout * 1000;
+    run->kill_at = 0;
+    run->open_streams[0] = run->open_streams[1] = true;
+    run->report_length = 0;
+    for (int i = 0; i < 2; i++) fcntl(run->captures[i].fd, F_SETFL, fcntl(run->captures[i].fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Function to list the process groups of the persistent shell's children. With set -m every pipeline it starts
+// gets its own, command substitutions stay in the shell's group and are listed by their pid as a negative number
+static int shell_job_groups(pid_t shell, pid_t *groups, int max) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)shell, (int)shell);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return 0;
+
+    int count = 0;
+    long child;
+    while (count < max && fscanf(file, "%ld", &child) == 1) {
+        pid_t group = getpgid((pid_t)child);
+        if (group <= 0) continue;
+        if (group == shell) group = -(pid_t)child;
+        bool seen = false;
+        for (int i = 0; i < count && !seen; i++) seen = groups[i] == group;
+        if (!seen) groups[count++] = group;
+    }
+    fclose(file);
+    return count;
+}
+
+// Function to signal what the persistent shell runs for the current command, jobs left by earlier commands and
+// the shell itself are spared
+static void shell_signal_jobs(const CommandRun *run, int signal) {
+    pid_t groups[64];
+    int count = shell_job_groups(run->pid, groups, 64);
+    for (int i = 0; i < count; i++) {
+        bool prior = false;
+        for (int j = 0; j < run->prior_job_count && !prior; j++) prior = run->prior_jobs[j] == groups[i];
+        if (!prior) kill(-groups[i], signal); // a whole group, or a single process given as a negative number
+    }
+}
+
+// Function to apply the timeout policy: the run's interrupt signal to its group, then SIGKILL after the grace
+// period. A persistent shell gets SIGINT for its trap while the command's own groups get both signals, the shell
+// is killed only when it still has not reported a grace period later. Returns when the run next needs a look even
+// without events, 0 for never
+static double command_run_check_timeout(CommandRun *run, double now) {
+    if (!run->timed_out && now >= run->deadline) {
+        if (run->persistent) {
+            kill(run->pid, run->interrupt_signal);
+            shell_signal_jobs(run, run->interrupt_signal);
+        } else {
+            kill(-run->pid, run->interrupt_signal);
+        }
+        run->timed_out = true;
+        run->kill_at = now + COMMAND_KILL_GRACE_MS;
+    } else if (run->kill_at > 0 && now >= run->kill_at) {
+        if (run->persistent) {
+            shell_signal_jobs(run, SIGKILL);
+            run->stop_at = now + COMMAND_KILL_GRACE_MS;
+        } else {
+            kill(-run->pid, SIGKILL);
+        }
+        run->kill_at = 0;
+    } else if (run->stop_at > 0 && now >= run->stop_at) {
+        kill(-run->pid, SIGKILL); // the shell is wedged, its state goes with it
+        run->stop_at = 0;
+    }
+
+    // Background jobs can hold the pipes open, without pidfd the exit is checked every 50ms
+    double wake = !run->timed_out ? run->deadline : run->kill_at > 0 ? run->kill_at : run->stop_at;
+    if (run->pidfd < 0 && (wake == 0 || wake > now + 50)) wake = now + 50;
+    return wake;
+}
+
+// Function to handle what poll reported for a run: output, the shell's status report or the exit
+static void command_run_events(CommandRun *run, const struct pollfd *fds) {
+    for (int i = 0; i < 2; i++) {
+        if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        ssize_t n;
+        while ((n = capture_read(&run->captures[i])) > 0) {
+            if (run->timing.first_output_ms < 0) run->timing.first_output_ms = monotonic_ms() - run->timing.started;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) run->open_streams[i] = false;
+    }
+
+    // The persistent shell reports "<nonce> <exit code>" once the command is over
+    if (fds[2].revents & (POLLIN | POLLHUP | POLLERR)) {
+        ssize_t n = read(run->status_fd, run->report + run->report_length, sizeof(run->report) - 1 - run->report_length);
+        if (n > 0) run->report_length += n;
+        run->report[run->report_length] = '\0';
+
+        size_t nonce_length = strlen(run->nonce);
+        char *line_end = strchr(run->report, '\n');
+        if (line_end && strncmp(run->report, run->nonce, nonce_length) == 0 && run->report[nonce_length] == ' ') {
+            run->status = W_EXITCODE(atoi(run->report + nonce_length + 1) & 0xff, 0);
+            run->done = true;
+        } else if (line_end || run->report_length == sizeof(run->report) - 1) {
+            run->report_length = 0; // not ours, left over from an interrupted command
+        }
+    }
+
+    if (run->pidfd < 0 || (fds[3].revents & POLLIN)) {
+        if (waitpid(run->pid, &run->status, WNOHANG) == run->pid) run->exited = run->done = true;
+    }
+    if (run->done) run->timing.exit_ms = monotonic_ms() - run->timing.started;
+}
+
+// Function to wrap up a finished run: stragglers, the rest of the output and the timing
+static void command_run_end(CommandRun *run) {
+    // Whatever outlived a one-shot command after a timeout ignored SIGTERM, and whatever the persistent shell's
+    // command left behind ignored SIGINT
+    if (run->timed_out && run->kill_at > 0 && run->exited) kill(-run->pid, SIGKILL);
+    else if (run->timed_out && run->kill_at > 0 && run->persistent) shell_signal_jobs(run, SIGKILL);
+
+    // Pick up what is still sitting in the pipes, without waiting on jobs left in the background
+    for (int i = 0; i < 2; i++) {
+        while (run->open_streams[i] && capture_read(&run->captures[i]) > 0) {}
+    }
+
+    if (run->pidfd >= 0) close(run->pidfd);
+    run->pidfd = -1;
+    run->timing.total_ms = monotonic_ms() - run->timing.started;
+}
+
+// Function to wait until at least one of the runs is done, every run wakes the loop the moment something happens
+static void supervise_commands(CommandRun **runs, int count) {
+    struct pollfd fds[count * 4];
+
+    for (;;) {
+        double now = monotonic_ms();
+        double wake = 0;
+        for (int i = 0; i < count; i++) {
+            if (runs[i]->done) return;
+
+            double run_wake = command_run_check_timeout(runs[i], now);
+            if (run_wake > 0 && (wake == 0 || run_wake < wake)) wake = run_wake;
+
+            struct pollfd *run_fds = &fds[i * 4];
+            for (int j = 0; j < 2; j++) {
+                run_fds[j] = (struct pollfd){ runs[i]->open_streams[j] ? runs[i]->captures[j].fd : -1, POLLIN, 0 };
+            }
+            run_fds[2] = (struct pollfd){ runs[i]->status_fd, POLLIN, 0 };
+            run_fds[3] = (struct pollfd){ runs[i]->pidfd, POLLIN, 0 };
+        }
+
+        int wait_ms = wake > 0 ? (int)(wake - now) + 1 : -1;
+        if (poll(fds, count * 4, wait_ms) < 0 && errno != EINTR) {
+            perror("Error waiting for child process");
+            usleep(10000); // the timeouts still apply on the next round
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) command_run_events(runs[i], &fds[i * 4]);
+    }
+}
+
+// Function to describe where the time of a command went, it is sent back along with the output
+static void format_command_timing(const CommandTiming *timing, char *out, size_t size) {
+    char first_output[32] = "none";
+    if (timing->first_output_ms >= 0) snprintf(first_output, sizeof(first_output), "%.1fms", timing->first_output_ms);
+    snprintf(out, size, "spawn %.1fms, first output %s, exit %.1fms, total %.1fms",
+             timing->spawn_ms, first_output, timing->exit_ms, timing->total_ms);
+}
+
+// Function to start bash with its stdout and stderr on their own pipes, and optionally a status pipe on fd 3
+static pid_t spawn_bash(Session *s, char *const argv[], int stdin_fd, int *out_fd, int *err_fd, int *status_fd) {
+    int pipes[3][2];
+    int pipe_count = status_fd ? 3 : 2;
+    for (int i = 0; i < pipe_count; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            perror("Pipe failed");
+            while (i-- > 0) {
+                close(pipes[i][0]);
+                close(pipes[i][1]);
+            }
+            return -1;
+        }
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (stdin_fd >= 0) posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipes[0][1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, pipes[1][1], STDERR_FILENO);
+    if (status_fd) posix_spawn_file_actions_adddup2(&actions, pipes[2][1], 3);
+    // Only a local session lends its terminal, daemon commands get nothing to read
+    if (stdin_fd < 0 && s->in != stdin) posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    // Commands run where the user invoked ai, not where the daemon happens to live
+    if (s->cwd) posix_spawn_file_actions_addchdir_np(&actions, s->cwd);
+
+    // Own process group so a timeout takes down everything the command started
+    posix_spawnattr_t attr;
+    sigset_t defaults, empty;
+    sigemptyset(&empty);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGINT);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &empty);
+
+    pid_t pid;
+    int rc = posix_spawnp(&pid, "bash", &actions, &attr, argv, s->env ? s->env : environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    for (int i = 0; i < pipe_count; i++) close(pipes[i][1]);
+
+    if (rc != 0) {
+        fprintf(s->err, "Error executing command: %s\n", strerror(rc));
+        for (int i = 0; i < pipe_count; i++) close(pipes[i][0]);
+        return -1;
+    }
+
+    *out_fd = pipes[0][0];
+    *err_fd = pipes[1][0];
+    if (status_fd) *status_fd = pipes[2][0];
+    return pid;
+}
+
+#if defined(__x86_64__)
+#define SANDBOX_AUDIT_ARCH AUDIT_ARCH_X86_64
+#define SANDBOX_SYSCALL_LIMIT 0x40000000 // x32 system calls have this bit, they would get around the filter
+#elif defined(__aarch64__)
+#define SANDBOX_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#define SANDBOX_SYSCALL_LIMIT 0xffffffff
+#endif
+#ifndef LANDLOCK_ACCESS_FS_REFER
+#define LANDLOCK_ACCESS_FS_REFER (1ULL << 13)
+#endif
+#ifndef LANDLOCK_ACCESS_FS_TRUNCATE
+#define LANDLOCK_ACCESS_FS_TRUNCATE (1ULL << 14)
+#endif
+
+// Function to lock the calling process down before it runs a command nobody approved yet: Landlock takes
+// every kind of write to the file system away (only /dev/null stays writable) and seccomp makes IPv4, IPv6
+// and raw sockets fail. Neither needs privileges or changes what the command sees of files and processes
+static bool sandbox_restrict(void) {
+#if defined(LANDLOCK_CREATE_RULESET_VERSION) && defined(SYS_landlock_create_ruleset) && defined(SANDBOX_AUDIT_ARCH)
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0) return false;
+
+    int abi = (int)syscall(SYS_landlock_create_ruleset, NULL, 0, LANDLOCK_CREATE_RULESET_VERSION);
+    if (abi < 1) return false;
+    struct landlock_ruleset_attr ruleset = {
+        .handled_access_fs = LANDLOCK_ACCESS_FS_WRITE_FILE | LANDLOCK_ACCESS_FS_REMOVE_DIR | LANDLOCK_ACCESS_FS_REMOVE_FILE |
+                             LANDLOCK_ACCESS_FS_MAKE_CHAR | LANDLOCK_ACCESS_FS_MAKE_DIR | LANDLOCK_ACCESS_FS_MAKE_REG |
+                             LANDLOCK_ACCESS_FS_MAKE_SOCK | LANDLOCK_ACCESS_FS_MAKE_FIFO | LANDLOCK_ACCESS_FS_MAKE_BLOCK |
+                             LANDLOCK_ACCESS_FS_MAKE_SYM |
+                             (abi >= 2 ? LANDLOCK_ACCESS_FS_REFER : 0) | (abi >= 3 ? LANDLOCK_ACCESS_FS_TRUNCATE : 0),
+    };
+    int ruleset_fd = (int)syscall(SYS_landlock_create_ruleset, &ruleset, sizeof(ruleset), 0);
+    if (ruleset_fd < 0) return false;
+
+    struct landlock_path_beneath_attr dev_null = {
+        .allowed_access = LANDLOCK_ACCESS_FS_WRITE_FILE | (abi >= 3 ? LANDLOCK_ACCESS_FS_TRUNCATE : 0),
+        .parent_fd = open("/dev/null", O_PATH | O_CLOEXEC),
+    };
+    if (dev_null.parent_fd >= 0) {
+        syscall(SYS_landlock_add_rule, ruleset_fd, LANDLOCK_RULE_PATH_BENEATH, &dev_null, 0);
+        close(dev_null.parent_fd);
+    }
+    bool ok = syscall(SYS_landlock_restrict_self, ruleset_fd, 0) == 0;
+    close(ruleset_fd);
+    if (!ok) return false;
+
+    // Other architectures and io_uring (which can open sockets on its own) are refused outright
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SANDBOX_AUDIT_ARCH, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EACCES),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, SANDBOX_SYSCALL_LIMIT, 7, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_io_uring_setup, 6, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_socket, 0, 4),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[0])),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_INET, 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_INET6, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AF_PACKET, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EACCES),
+    };
+    struct sock_fprog program = { .len = sizeof(filter) / sizeof(filter[0]), .filter = filter };
+    return prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program, 0, 0) == 0;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
+
+// Function to start a command in the sandbox at the lowest CPU and I/O priority, with nothing to read.
+// posix_spawn cannot set all that up, so this one forks; a setup failure comes back as its errno
+static pid_t spawn_sandboxed(Session *s, const char *command, int *out_fd, int *err_fd) {
+    int pipes[3][2]; // stdout, stderr, setup errors
+    for (int i = 0; i < 3; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            int saved = errno;
+            while (i-- > 0) {
+                close(pipes[i][0]);
+                close(pipes[i][1]);
+            }
+            errno = saved;
+            return -1;
+        }
+    }
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    char *argv[] = { "bash", "-c", (char *)command, NULL };
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        if (null_fd >= 0) dup2(null_fd, STDIN_FILENO);
+        dup2(pipes[0][1], STDOUT_FILENO);
+        dup2(pipes[1][1], STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        sigset_t empty;
+        sigemptyset(&empty);
+        sigprocmask(SIG_SETMASK, &empty, NULL);
+
+        setpriority(PRIO_PROCESS, 0, 19);
+#ifdef SYS_ioprio_set
+        syscall(SYS_ioprio_set, 1, 0, 3 << 13); // IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE
+#endif
+        if ((s->cwd == NULL || chdir(s->cwd) == 0) && sandbox_restrict()) execvpe("bash", argv, s->env ? s->env : environ);
+        int error = errno;
+        write_full(pipes[2][1], &error, sizeof(error));
+        _exit(127);
+    }
+
+    int saved = errno;
+    if (pid > 0) setpgid(pid, pid); // also here, so a kill right away reaches the group
+    if (null_fd >= 0) close(null_fd);
+    for (int i = 0; i < 3; i++) close(pipes[i][1]);
+    if (pid < 0) {
+        for (int i = 0; i < 3; i++) close(pipes[i][0]);
+        errno = saved;
+        return -1;
+    }
+
+    // The pipe closes on exec, anything in it means the sandbox could not be set up
+    int error;
+    ssize_t n;
+    while ((n = read(pipes[2][0], &error, sizeof(error))) < 0 && errno == EINTR) {}
+    close(pipes[2][0]);
+    if (n == sizeof(error)) {
+        waitpid(pid, NULL, 0);
+        close(pipes[0][0]);
+        close(pipes[1][0]);
+        errno = error;
+        return -1;
+    }
+
+    *out_fd = pipes[0][0];
+    *err_fd = pipes[1][0];
+    return pid;
+}
+
+// Function to stop the session's shell, closing its input is enough unless it is stuck
+void shell_stop(PersistentShell *shell, bool reaped) {
+    if (shell->pid <= 0) return;
+    close(shell->in_fd);
+    close(shell->out_fd);
+    close(shell->err_fd);
+    close(shell->status_fd);
+
+    for (int i = 0; i < 100 && !reaped; i++) {
+        reaped = waitpid(shell->pid, NULL, WNOHANG) == shell->pid;
+        if (!reaped) usleep(10000);
+    }
+    if (!reaped) {
+        kill(-shell->pid, SIGKILL);
+        waitpid(shell->pid, NULL, 0);
+    }
+    shell->pid = 0;
+}
+
+// Function to start the long-lived shell of a session. Commands run inside __ai_run, so the INT trap
+// returns from the whole command instead of carrying on with its next part, and the shell itself survives.
+// set -m puts every pipeline in a group of its own, a timeout can SIGKILL it without taking the shell along
+static bool shell_start(Session *s) {
+    PersistentShell *shell = &s->shell;
+    int in_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) == -1) {
+        perror("Pipe failed");
+        return false;
+    }
+
+    char *argv[] = { "bash", "--noprofile", "--norc", NULL };
+    shell->pid = spawn_bash(s, argv, in_pipe[0], &shell->out_fd, &shell->err_fd, &shell->status_fd);
+    close(in_pipe[0]);
+    if (shell->pid < 0) {
+        close(in_pipe[1]);
+        shell->pid = 0;
+        return false;
+    }
+    shell->in_fd = in_pipe[1];
+
+    // A shell dying mid-write must not take ai down with it
+    signal(SIGPIPE, SIG_IGN);
+    const char *init = "__ai_run() { eval \"$__ai_cmd\"; }\ntrap 'return 130 2>/dev/null' INT\nset -m\n";
+    return write_full(shell->in_fd, init, strlen(init));
+}
+
+// Function to hand one command to the persistent shell, framed by a fresh nonce so its text is passed verbatim
+static bool shell_send(Session *s, const char *command, char *nonce, size_t nonce_size) {
+    unsigned char random_bytes[16];
+    if (getrandom(random_bytes, sizeof(random_bytes), 0) != sizeof(random_bytes)) return false;
+    size_t n = snprintf(nonce, nonce_size, "AI_");
+    for (size_t i = 0; i < sizeof(random_bytes) && n + 2 < nonce_size; i++) {
+        n += snprintf(nonce + n, nonce_size - n, "%02x", random_bytes[i]);
+    }
+
+    // Drop what background jobs printed since the last command
+    char scratch[4096];
+    int stale_fds[] = { s->shell.out_fd, s->shell.err_fd, s->shell.status_fd };
+    for (size_t i = 0; i < sizeof(stale_fds) / sizeof(stale_fds[0]); i++) {
+        fcntl(stale_fds[i], F_SETFL, fcntl(stale_fds[i], F_GETFL) | O_NONBLOCK);
+        while (read(stale_fds[i], scratch, sizeof(scratch)) > 0) {}
+    }
+
+    ByteBuffer script = {0};
+    bool ok = buffer_printf(&script, "IFS= read -r -d '' __ai_cmd <<'%s'\n%s\n%s\n"
+                                     "__ai_run </dev/null 3>&-; printf '%%s %%d\\n' %s \"$?\" >&3\n",
+                            nonce, command, nonce, nonce) &&
+              write_full(s->shell.in_fd, script.data, script.length);
+    buffer_free(&script);
+    return ok;
+}
+
+// Function to append one captured stream, reduced for the model or as it came
+static bool format_command_output(const OutputCapture *c, bool reduce, ByteBuffer *result) {
+    if (!reduce) return capture_render(c, result);
+
+    ByteBuffer raw = {0};
+    bool ok = capture_render(c, &raw) && output_reduce(raw.data ? raw.data : "", raw.length, result);
+    buffer_free(&raw);
+    return ok;
+}
+
+// Function to fill in the result line for a command that ran, reduced for the model or whole for the terminal
+static void format_command_result(CommandRun *run, const char *command, bool shell_lost, bool reduce, ByteBuffer *result) {
+    char timing_text[128];
+    format_command_timing(&run->timing, timing_text, sizeof(timing_text));
+
+    int status = run->status;
+    buffer_printf(result, "command executed: <%s> status: <%s>", command, run->timed_out ? "timeout" : "executed");
+    if (!run->timed_out && WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        buffer_printf(result, " exit code: <%d>", WEXITSTATUS(status));
+    } else if (!run->timed_out && WIFSIGNALED(status)) {
+        buffer_printf(result, " killed by: <%s>", strsignal(WTERMSIG(status)));
+    }
+
+    if (run->captures[0].total == 0 && run->captures[1].total == 0) {
+        if (!run->timed_out) buffer_printf(result, " output: <Empty or Execution error>");
+    } else {
+        buffer_printf(result, " output: <");
+        format_command_output(&run->captures[0], reduce, result);
+        buffer_printf(result, ">");
+        if (run->captures[1].total > 0) {
+            buffer_printf(result, " errors: <");
+            format_command_output(&run->captures[1], reduce, result);
+            buffer_printf(result, ">");
+        }
+    }
+    if (shell_lost) buffer_printf(result, " note: <the shell exited, its directory and variables were reset>");
+    buffer_printf(result, " timing: <%s>", timing_text);
+}
+
+// Function to write a command with its runs of blanks outside quotes made single spaces, so "df  -h" is "df -h"
+static bool command_normalize(const char *command, ByteBuffer *out) {
+    char quote = 0;
+    bool blank = false;
+    out->length = 0;
+    for (const char *p = command; *p; p++) {
+        bool is_blank = !quote && (*p == ' ' || *p == '\t');
+        if (!is_blank && blank && out->length > 0 && !buffer_append(out, " ", 1)) return false;
+        blank = is_blank;
+        if (is_blank) continue;
+        if (quote ? *p == quote : (*p == '\'' || *p == '"')) quote = quote ? 0 : *p;
+        if (!buffer_append(out, p, 1)) return false;
+    }
+    return buffer_append(out, "", 0);
+}
+
+// Function to match one stage of a pipeline against READONLY: a plain name allows the program
+// with any arguments, anything else is a shell pattern for the whole stage
+static bool readonly_stage_allowed(const char *stage, size_t length) {
+    char text[1024];
+    if (length == 0 || length >= sizeof(text)) return false;
+    memcpy(text, stage, length);
+    text[length] = '\0';
+
+    // The program without its directory, /bin/ls is ls
+    size_t name_end = strcspn(text, " ");
+    const char *name = memrchr(text, '/', name_end);
+    name = name ? name + 1 : text;
+    size_t name_length = text + name_end - name;
+
+    for (const char *entry = config.readonly; entry && *entry; ) {
+        size_t entry_length = strcspn(entry, "\n");
+        char pattern[1024];
+        if (entry_length > 0 && entry_length < sizeof(pattern)) {
+            memcpy(pattern, entry, entry_length);
+            pattern[entry_length] = '\0';
+            if (strpbrk(pattern, " *?[") == NULL) {
+                if (entry_length == name_length && memcmp(pattern, name, name_length) == 0) return true;
+            } else if (fnmatch(pattern, text, 0) == 0) {
+                return true;
+            }
+        }
+        entry += entry_length + (entry[entry_length] == '\n');
+    }
+    return false;
+}
+
+// Function to tell whether a normalized command only reads, every stage of a pipeline has to be allowed.
+// Redirections, lists, substitutions and expansions are never read-only, even inside quotes
+static bool command_is_readonly(const char *normalized) {
+    if (config.readonly == NULL || strpbrk(normalized, ";&<>`$\\\n") != NULL) return false;
+    for (const char *stage = normalized; ; ) {
+        while (*stage == ' ') stage++;
+        size_t length = strcspn(stage, "|");
+        while (length > 0 && stage[length - 1] == ' ') length--;
+        if (!readonly_stage_allowed(stage, length)) return false;
+        stage = strchr(stage, '|');
+        if (stage == NULL) return true;
+        stage++;
+    }
+}
+
+// Function to build the cache key of a command, NULL when it is not read-only
+static char *readonly_cache_key(Session *s, const char *command) {
+    ByteBuffer key = {0};
+    char cwd[4096];
+    const char *dir = s->cwd ? s->cwd : getcwd(cwd, sizeof(cwd)) ? cwd : "";
+    if (config.readonly_ttl <= 0 || !command_normalize(command, &key) || !command_is_readonly(key.data) ||
+        !buffer_append(&key, "\n", 1) || !buffer_append(&key, dir, strlen(dir))) {
+        buffer_free(&key);
+        return NULL;
+    }
+    return key.data;
+}
+
+// Function to forget every kept result, something may have changed under them
+static void readonly_cache_clear(ReadonlyCache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        free(cache->entries[i].key);
+        free(cache->entries[i].result);
+    }
+    cache->count = 0;
+}
+
+// Function to find the kept result of a command, expired ones are dropped on the way
+static const ReadonlyResult *readonly_cache_lookup(ReadonlyCache *cache, const char *key) {
+    double now = monotonic_ms();
+    for (int i = 0; i < cache->count; ) {
+        ReadonlyResult *entry = &cache->entries[i];
+        if (now - entry->stored_at > config.readonly_ttl * 1000.0) {
+            free(entry->key);
+            free(entry->result);
+            *entry = cache->entries[--cache->count];
+            continue;
+        }
+        if (strcmp(entry->key, key) == 0) return entry;
+        i++;
+    }
+    return NULL;
+}
+
+// Function to keep the result of a read-only command, the oldest one makes room when full. Takes over key
+static void readonly_cache_store(ReadonlyCache *cache, char *key, const char *result) {
+    char *copy = strdup(result);
+    if (copy == NULL) {
+        free(key);
+        return;
+    }
+
+    ReadonlyResult *entry = NULL;
+    for (int i = 0; i < cache->count && entry == NULL; i++) {
+        if (strcmp(cache->entries[i].key, key) == 0) entry = &cache->entries[i];
+    }
+    if (entry == NULL && cache->count == READONLY_CACHE_ENTRIES) {
+        entry = &cache->entries[0];
+        for (int i = 1; i < cache->count; i++) {
+            if (cache->entries[i].stored_at < entry->stored_at) entry = &cache->entries[i];
+        }
+    }
+    if (entry) {
+        free(entry->key);
+        free(entry->result);
+    } else {
+        entry = &cache->entries[cache->count++];
+    }
+    *entry = (ReadonlyResult){ key, copy, monotonic_ms() };
+}
+
+// Function to answer a command from its kept result, marked so neither the user nor the model takes it for a new run
+static bool readonly_cache_reuse(Session *s, const char *command, ByteBuffer *result) {
+    char *key = readonly_cache_key(s, command);
+    const ReadonlyResult *cached = key ? readonly_cache_lookup(&s->readonly, key) : NULL;
+    free(key);
+    if (cached == NULL) return false;
+
+    return buffer_printf(result, "%s note: <cached result from %.0fs ago, the command was not run again>", cached->result,
+                         (monotonic_ms() - cached->stored_at) / 1000);
+}
+
+// Function to start one approved command, in a fresh bash -c or in the session's persistent shell
+static bool command_start(Session *s, CommandRun *run, const char *command, int stdin_fd, bool sandboxed) {
+    bool persistent = config.exec_persistent && !sandboxed;
+    *run = (CommandRun){
+        .pid = -1,
+        .status_fd = -1,
+        .pidfd = -1,
+        .interrupt_signal = persistent ? SIGINT : SIGTERM,
+        .persistent = persistent,
+        .timing = { .started = monotonic_ms(), .first_output_ms = -1 },
+    };
+
+    // Anything that may write makes every kept result stale, the sandbox cannot write
+    char *key = readonly_cache_key(s, command);
+    run->readonly = key != NULL;
+    free(key);
+    if (!run->readonly && !sandboxed) {
+        readonly_cache_clear(&s->readonly);
+        s->readonly.generation++;
+    }
+    run->generation = s->readonly.generation;
+    for (int i = 0; i < 2; i++) {
+        run->captures[i] = (OutputCapture){ .fd = -1, .head_limit = config.output_head, .tail_limit = config.output_tail };
+    }
+
+    fflush(s->out);
+    if (sandboxed) {
+        run->pid = spawn_sandboxed(s, command, &run->captures[0].fd, &run->captures[1].fd);
+    } else if (persistent) {
+        if (s->shell.pid > 0) {
+            int max = sizeof(run->prior_jobs) / sizeof(run->prior_jobs[0]);
+            run->prior_job_count = shell_job_groups(s->shell.pid, run->prior_jobs, max);
+        }
+        if ((s->shell.pid > 0 || shell_start(s)) && shell_send(s, command, run->nonce, sizeof(run->nonce))) {
+            run->pid = s->shell.pid;
+            run->status_fd = s->shell.status_fd;
+            run->captures[0].fd = s->shell.out_fd;
+            run->captures[1].fd = s->shell.err_fd;
+        } else {
+            shell_stop(&s->shell, false);
+        }
+    } else {
+        // bash gets the command as its own argument, no quoting or escaping needed
+        char *argv[] = { "bash", "-c", (char *)command, NULL };
+        run->pid = spawn_bash(s, argv, stdin_fd, &run->captures[0].fd, &run->captures[1].fd, NULL);
+    }
+    if (run->pid < 0) return false;
+
+    run->timing.spawn_ms = monotonic_ms() - run->timing.started;
+    command_run_begin(run);
+    return true;
+}
+
+// Function to collect a finished run and release it: result gets what the model is sent, shown what the terminal shows
+// when the two differ
+static void command_finish(Session *s, CommandRun *run, const char *command, ByteBuffer *result, ByteBuffer *shown) {
+    if (run->timed_out) fprintf(s->out, "Command timed out. Killing process.\n");
+    bool shell_lost = run->persistent && run->exited;
+    format_command_result(run, command, shell_lost, config.output_reduce, result);
+    if (config.output_reduce) format_command_result(run, command, shell_lost, false, shown);
+
+    // Only kept when nothing that may write started while it ran
+    if (run->readonly && !run->timed_out && run->generation == s->readonly.generation && result->data) {
+        char *key = readonly_cache_key(s, command);
+        if (key) readonly_cache_store(&s->readonly, key, result->data);
+    }
+
+    if (s->stats.enabled) {
+        s->stats.commands++;
+        s->stats.child_wait_ms += run->timing.exit_ms;
+
+        ByteBuffer args = {0};
+        size_t length = strnlen(command, 200);
+        if (buffer_append(&args, "\"command\":\"", strlen("\"command\":\"")) &&
+            buffer_reserve(&args, json_escaped_length(command, length))) {
+            args.length = json_escape(args.data + args.length, command, length) - args.data;
+            buffer_printf(&args, "\",\"spawn_ms\":%.3f,\"first_output_ms\":%.3f,\"exit_ms\":%.3f,\"output_bytes\":%llu,"
+                                 "\"result_bytes\":%zu",
+                          run->timing.spawn_ms, run->timing.first_output_ms, run->timing.exit_ms,
+                          (unsigned long long)(run->captures[0].total + run->captures[1].total), result->length);
+            stats_trace(s, "command", "command", run->timing.started, run->timing.total_ms, args.data);
+        }
+        buffer_free(&args);
+    }
+
+    if (run->persistent) {
+        // The shell keeps its pipes, only a dead one is cleaned up and started again next time
+        for (int i = 0; i < 2; i++) run->captures[i].fd = -1;
+        if (run->exited) shell_stop(&s->shell, true);
+    }
+    for (int i = 0; i < 2; i++) capture_free(&run->captures[i]);
+}
+
+// Function to run one approved command and wait for it
+static void run_command(Session *s, const char *command, ByteBuffer *result, ByteBuffer *shown) {
+    // Commands only get the terminal when this session owns it, never from the daemon
+    bool owns_terminal = s->in == stdin && isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();
+    CommandRun run;
+
+    if (!command_start(s, &run, command, -1, false)) {
+        buffer_printf(result, "command executed: <%s> status: <failed to start>", command);
+        return;
+    }
+    if (owns_terminal) {
+        hand_terminal_to(run.pid);
+        kill(-run.pid, SIGCONT); // in case it touched the terminal before it was handed over
+    }
+
+    CommandRun *runs[] = { &run };
+    while (!run.done) supervise_commands(runs, 1);
+    command_run_end(&run);
+    if (owns_terminal) hand_terminal_to(getpgrp());
+
+    command_finish(s, &run, command, result, shown);
+}
+
+// Speculation thread: supervises the sandboxed run to its end while the main thread waits for the answer
+static void *speculation_thread(void *arg) {
+    CommandRun *run = arg;
+    CommandRun *runs[] = { run };
+    while (!run->done) supervise_commands(runs, 1);
+    command_run_end(run);
+    return NULL;
+}
+
+// Function to start a proposed command before it is approved when SPECULATE allows it: read-only ones only,
+// and never for the persistent shell, whose directory and variables the sandbox would not have
+static void speculation_start(Session *s, const char *command, Speculation *spec) {
+    static bool warned;
+    ByteBuffer normalized = {0};
+    spec->started = false;
+    bool readonly = config.speculate && !config.exec_persistent && command_normalize(command, &normalized) &&
+                    command_is_readonly(normalized.data);
+    buffer_free(&normalized);
+    if (!readonly) return;
+
+    if (!command_start(s, &spec->run, command, -1, true)) {
+        if (!warned) fprintf(s->err, "Commands are not started before approval, no sandbox: %s\n", strerror(errno));
+        warned = true;
+        return;
+    }
+    if (pthread_create(&spec->thread, NULL, speculation_thread, &spec->run) != 0) {
+        kill(-spec->run.pid, SIGKILL);
+        speculation_thread(&spec->run);
+        for (int i = 0; i < 2; i++) capture_free(&spec->run.captures[i]);
+        return;
+    }
+    spec->started = true;
+}
+
+// Function to throw a speculative run away, killing it if it is still going
+static void speculation_discard(Speculation *spec) {
+    if (!spec->started) return;
+    kill(-spec->run.pid, SIGKILL);
+    pthread_join(spec->thread, NULL);
+    for (int i = 0; i < 2; i++) capture_free(&spec->run.captures[i]);
+    spec->started = false;
+}
+
+// Function to use the speculative run of an approved command once it is over. Only a clean run counts:
+// errors and anything on stderr may come from the sandbox itself, so then the command runs again for real
+static bool speculation_finish(Session *s, Speculation *spec, const char *command, ByteBuffer *result, ByteBuffer *shown) {
+    if (!spec->started) return false;
+    pthread_join(spec->thread, NULL);
+    spec->started = false;
+
+    CommandRun *run = &spec->run;
+    if (run->timed_out || !WIFEXITED(run->status) || WEXITSTATUS(run->status) != 0 || run->captures[1].total > 0) {
+        for (int i = 0; i < 2; i++) capture_free(&run->captures[i]);
+        return false;
+    }
+
+    double ahead = (monotonic_ms() - run->timing.started) / 1000;
+    fprintf(s->out, "It already ran in a read-only sandbox while you were reading, started %.1fs ago.\n", ahead);
+    command_finish(s, run, command, result, shown);
+    buffer_printf(result, " note: <run in a read-only sandbox while waiting for approval, started %.0fs before it>", ahead);
+    return true;
+}
+
+// Function to run the approved commands of a batch side by side, at most CMDCONCURRENCY at a time.
+// The persistent shell can only do one thing at a time, so there they simply run in order
+static void run_command_batch(Session *s, char **commands, const bool *approved, int count, ByteBuffer *results,
+                              ByteBuffer *shown) {
+    if (config.exec_persistent || config.cmd_concurrency <= 1) {
+        for (int i = 0; i < count; i++) {
+            if (approved[i]) run_command(s, commands[i], &results[i], &shown[i]);
+        }
+        return;
+    }
+
+    // Several commands cannot share the terminal, they read from /dev/null instead
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int concurrency = config.cmd_concurrency < count ? (int)config.cmd_concurrency : count;
+    CommandRun *runs = calloc(count, sizeof(CommandRun));
+    CommandRun **active = calloc(concurrency, sizeof(CommandRun *));
+    if (runs == NULL || active == NULL) {
+        perror("Failed to allocate memory for commands");
+        free(runs);
+        free(active);
+        if (null_fd >= 0) close(null_fd);
+        return;
+    }
+
+    int next = 0, active_count = 0;
+    for (;;) {
+        while (active_count < concurrency && next < count) {
+            int i = next++;
+            if (!approved[i]) continue;
+            if (command_start(s, &runs[i], commands[i], null_fd, false)) {
+                active[active_count++] = &runs[i];
+            } else {
+                buffer_printf(&results[i], "command executed: <%s> status: <failed to start>", commands[i]);
+            }
+        }
+        if (active_count == 0) break;
+
+        supervise_commands(active, active_count);
+        for (int j = 0; j < active_count; ) {
+            CommandRun *run = active[j];
+            if (!run->done) {
+                j++;
+                continue;
+            }
+            int i = run - runs;
+            command_run_end(run);
+            fprintf(s->out, "Command %d finished in %.1fms\n", i + 1, run->timing.total_ms);
+            command_finish(s, run, commands[i], &results[i], &shown[i]);
+            active[j] = active[--active_count];
+        }
+    }
+
+    free(runs);
+    free(active);
+    if (null_fd >= 0) close(null_fd);
+}
+
+// Function to ask whether to go on after declined commands, the next user message is read when it is a yes
+static void ask_to_continue(Session *s) {
+    char user_input[10];
+    fprintf(s->out, "Do you want to continue the conversation? (yes/no) [no]: ");
+
+    read_user_line(s, user_input, sizeof(user_input));
+    if (strncmp(user_input, "yes", 3) == 0) {
+        fprintf(s->out, "Enter your next message: ");
+        char user_message[RESPONSE_BUFFER_SIZE];
+        read_user_line(s, user_message, sizeof(user_message));
+        user_message[strcspn(user_message, "\n")] = '\0';
+        append_conversation_entry(s, ROLE_USER, user_message);
+    } else {
+        fprintf(s->out, "Bye Bye!\n");
+        end_session(s, 0);
+    }
+}
+
+// Function to ask whether a command may run, read-only ones may already run in the sandbox while it is read
+static void ask_approval(Session *s, const char *command, Speculation *spec, char *answer, size_t size) {
+    speculation_start(s, command, spec);
+    fprintf(s->out, "I need to run this command: %s\n", command);
+    fprintf(s->out, "Do you want to proceed? (yes/no/exit) [no]: ");
+    read_user_line(s, answer, size);
+}
+
+// Function to drop an early answer nothing picked up, the reply failed or its first command changed
+static void approval_discard(Session *s) {
+    if (s->approval == NULL) return;
+    speculation_discard(&s->approval->spec);
+    free(s->approval->command);
+    free(s->approval);
+    s->approval = NULL;
+}
+
+// Execute the command on the shell through bash
+void execute_command(Session *s, const char *command) {
+    ByteBuffer result = {0}, shown = {0};
+    Speculation own_spec, *spec = &own_spec;
+    EarlyApproval *early = NULL;
+    char user_input[10];
+
+    if (s->approval && strcmp(s->approval->command, command) == 0) {
+        // Already asked while the rest of the reply was streaming in, its sandboxed run goes on from there
+        early = s->approval;
+        s->approval = NULL;
+        memcpy(user_input, early->answer, sizeof(user_input));
+        spec = &early->spec;
+    } else if (readonly_cache_reuse(s, command, &result)) {
+        fprintf(s->out, "Cached output of %s, not run again:\n%s\n", command, result.data);
+        append_conversation_entry(s, ROLE_USER, result.data);
+        buffer_free(&result);
+        return;
+    } else {
+        ask_approval(s, command, spec, user_input, sizeof(user_input));
+    }
+    if (strncmp(user_input, "yes", 3) != 0) speculation_discard(spec);
+
+    // Default to "no" if input is empty or doesn't start with "yes" or "exit"
+    if (strncmp(user_input, "yes", 3) == 0) {
+        double started = stats_begin(s);
+        if (!speculation_finish(s, spec, command, &result, &shown)) run_command(s, command, &result, &shown);
+        stats_end(s, PHASE_EXEC, started, NULL);
+        if (result.data) {
+            fprintf(s->out, "Command output:\n%s\n", shown.data ? shown.data : result.data);
+            append_conversation_entry(s, ROLE_USER, result.data);
+        }
+    } else if (strncmp(user_input, "exit", 4) == 0) {
+        fprintf(s->out, "Bye Bye!\n");
+        end_session(s, 0); // End the conversation immediately
+    } else {
+        buffer_printf(&result, "command executed: <%s> status: <sysadmin declined to execute command.>", command);
+        if (result.data) append_conversation_entry(s, ROLE_USER, result.data);
+        ask_to_continue(s);
+    }
+    buffer_free(&result);
+    buffer_free(&shown);
+    if (early) {
+        free(early->command);
+        free(early);
+    }
+}
+
+// Function to read which commands of a batch were approved: yes/all, or numbers and ranges like "1,3 5-6"
+static int parse_command_selection(const char *input, bool *approved, int count) {
+    int selected = 0;
+    if (strncmp(input, "yes", 3) == 0 || strncmp(input, "all", 3) == 0) {
+        for (int i = 0; i < count; i++) approved[i] = true;
+        return count;
+    }
+
+    const char *p = input;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            p++; // separators and anything else
+            continue;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1) last = first;
+            p = end;
+        }
+        for (long n = first; n <= last && n <= count; n++) {
+            if (n >= 1 && !approved[n - 1]) {
+                approved[n - 1] = true;
+                selected++;
+            }
+        }
+    }
+    return selected;
+}
+
+// Function to approve several commands at once, they run in parallel and come back as one message in their original order
+void execute_command_batch(Session *s, char **commands, int count) {
+    bool *approved = calloc(count, sizeof(bool));
+    // What the model gets, then from count on what the terminal shows when it differs
+    ByteBuffer *results = calloc(count * 2, sizeof(ByteBuffer));
+    if (approved == NULL || results == NULL) {
+        perror("Failed to allocate memory for commands");
+        free(approved);
+        free(results);
+        return;
+    }
+
+    // Read-only commands that ran a moment ago are answered already, only the others are asked about
+    int cached = 0;
+    for (int i = 0; i < count; i++) {
+        if (readonly_cache_reuse(s, commands[i], &results[i])) cached++;
+    }
+
+    int selected = 0;
+    if (cached < count) {
+        fprintf(s->out, "I need to run these commands:\n");
+        for (int i = 0; i < count; i++) {
+            fprintf(s->out, "  %d) %s%s\n", i + 1, commands[i], results[i].data ? " (cached, not run again)" : "");
+        }
+        fprintf(s->out, "Do you want to proceed? (yes/no/exit, or numbers like 1,3) [no]: ");
+
+        char user_input[256];
+        read_user_line(s, user_input, sizeof(user_input));
+        if (strncmp(user_input, "exit", 4) == 0) {
+            fprintf(s->out, "Bye Bye!\n");
+            end_session(s, 0);
+            for (int i = 0; i < count; i++) buffer_free(&results[i]);
+            free(results);
+            free(approved);
+            return;
+        }
+
+        selected = parse_command_selection(user_input, approved, count);
+        for (int i = 0; i < count; i++) {
+            if (approved[i] && results[i].data) {
+                approved[i] = false;
+                selected--;
+            }
+        }
+        if (selected > 0) {
+            double started = stats_begin(s);
+            run_command_batch(s, commands, approved, count, results, results + count);
+            stats_end(s, PHASE_EXEC, started, NULL);
+        }
+    }
+
+    ByteBuffer combined = {0}, display = {0};
+    for (int i = 0; i < count; i++) {
+        const ByteBuffer *shown = results[count + i].data ? &results[count + i] : &results[i];
+        if (i > 0) {
+            buffer_append(&combined, "\n\n", 2);
+            buffer_append(&display, "\n\n", 2);
+        }
+        if (results[i].data) {
+            buffer_append(&combined, results[i].data, results[i].length);
+            buffer_append(&display, shown->data, shown->length);
+        } else {
+            buffer_printf(&combined, "command executed: <%s> status: <sysadmin declined to execute command.>", commands[i]);
+            buffer_printf(&display, "command executed: <%s> status: <sysadmin declined to execute command.>", commands[i]);
+        }
+    }
+    for (int i = 0; i < count * 2; i++) buffer_free(&results[i]);
+
+    if (combined.data) {
+        if (selected > 0 || cached > 0) fprintf(s->out, "Command output:\n%s\n", display.data ? display.data : combined.data);
+        append_conversation_entry(s, ROLE_USER, combined.data);
+    }
+    if (selected == 0 && cached == 0) ask_to_continue(s);
+
+    buffer_free(&combined);
+    buffer_free(&display);
+    free(results);
+    free(approved);
+}
+
+// Function to look for '<', '`' or the NUL byte by byte, up to end at most
+static const char *find_markup_bytes(const char *s, const char *end) {
+    for (; s < end; s++) {
+        if (*s == '\0' || *s == '<' || *s == '`') return s;
+    }
+    return end;
+}
+
+#ifdef __SSE2__
+// Wide loads must not run into the next page, the string may end just before it
+#define MARKUP_PAGE_END(s) ((const char *)(((uintptr_t)(s) | 4095) + 1))
+#define MARKUP_NEAR_PAGE_END(s, width) (((uintptr_t)(s) & 4095) > 4096 - (width))
+
+// A byte is a hit when the smallest of v, v ^ '<' and v ^ '`' is zero.
+// Reading past the end of the string within its page is fine, but not to AddressSanitizer
+__attribute__((no_sanitize_address))
+static const char *find_markup_sse2(const char *s) {
+    const __m128i lt = _mm_set1_epi8('<'), tick = _mm_set1_epi8('`'), zero = _mm_setzero_si128();
+    for (;;) {
+        if (MARKUP_NEAR_PAGE_END(s, 64)) {
+            s = find_markup_bytes(s, MARKUP_PAGE_END(s));
+            if (((uintptr_t)s & 4095) != 0) return s;
+            continue;
+        }
+        __m128i folded[4];
+        for (int i = 0; i < 4; i++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 16));
+            folded[i] = _mm_min_epu8(v, _mm_min_epu8(_mm_xor_si128(v, lt), _mm_xor_si128(v, tick)));
+        }
+        __m128i any = _mm_min_epu8(_mm_min_epu8(folded[0], folded[1]), _mm_min_epu8(folded[2], folded[3]));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero))) {
+            uint64_t mask = 0;
+            for (int i = 0; i < 4; i++) mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(folded[i], zero)) << (i * 16);
+            return s + __builtin_ctzll(mask);
+        }
+        s += 64;
+    }
+}
+
+__attribute__((target("avx2"), no_sanitize_address))
+static const char *find_markup_avx2(const char *s) {
+    const __m256i lt = _mm256_set1_epi8('<'), tick = _mm256_set1_epi8('`'), zero = _mm256_setzero_si256();
+    for (;;) {
+        if (MARKUP_NEAR_PAGE_END(s, 64)) {
+            s = find_markup_bytes(s, MARKUP_PAGE_END(s));
+            if (((uintptr_t)s & 4095) != 0) return s;
+            continue;
+        }
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        a = _mm256_min_epu8(a, _mm256_min_epu8(_mm256_xor_si256(a, lt), _mm256_xor_si256(a, tick)));
+        b = _mm256_min_epu8(b, _mm256_min_epu8(_mm256_xor_si256(b, lt), _mm256_xor_si256(b, tick)));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(a, b), zero))) {
+            uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero)) |
+                            (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero)) << 32;
+            return s + __builtin_ctzll(mask);
+        }
+        s += 64;
+    }
+}
+#endif
 
-    while (fgets(line, sizeof(line), config_file)) {
-        // Check if the line starts with the key prefix
-        if (strncmp(line, key_prefix, strlen(key_prefix)) == 0) {
-            // Get the part after the key_prefix (skip key and '=')
-            char *line_value = line + strlen(key_prefix) + 1;
-            size_t line_value_len = strlen(line_value);
+// Set to run one implementation whatever the CPU has, bench/fuzz_markup.c checks them against each other
+static const char *(*find_markup_forced)(const char *s);
 
-            // Remove newline character
-            if (line_value[line_value_len - 1] == '\n') {
-                line_value[line_value_len - 1] = '\0';
-                line_value_len--;
-            }
+// Function to find the next '<' or '`' of a reply, or its end. Finding the end on the way
+// saves a strlen, so the reply is read once, 64 bytes per step with AVX2 or SSE2
+static const char *find_markup(const char *s) {
+    if (find_markup_forced) return find_markup_forced(s);
+#ifdef __SSE2__
+    return __builtin_cpu_supports("avx2") ? find_markup_avx2(s) : find_markup_sse2(s);
+#else
+    while (*s && *s != '<' && *s != '`') s++;
+    return s;
+#endif
+}
 
-            // Reallocate and append to the cumulative value string
-            char *new_value = realloc(value, value_len + line_value_len + 2); // +1 for space, +1 for '\0'
-            if (new_value == NULL) {
-                perror("Failed to allocate memory for configuration value");
-                free(value);
-                fclose(config_file);
-                return NULL;
-            }
+// Function to collect every complete <CMD></CMD> block of a reply in a single pass.
+// Triple backticks inside a block are dropped, and so is a shell name right after the first of them
+static bool collect_commands(const char *response, CommandList *list) {
+    static const char start_tag[] = "<CMD>", end_tag[] = "</CMD>";
+    static const char *const fence_languages[] = { "bash\n", "sh\n", "shell\n", "zsh\n", "console\n" };
+    size_t *starts = NULL;
+    size_t capacity = 0;
+    size_t command_start = 0;
+    bool in_command = false, fenced = false, ok = true;
 
-            value = new_value;
-            strcpy(value + value_len, line_value);
-            value_len += line_value_len;
+    memset(list, 0, sizeof(*list));
+    for (const char *p = response; ok; ) {
+        const char *next = find_markup(p);
+        if (in_command && next > p) ok = buffer_append(&list->text, p, next - p);
+        p = next;
+        if (*p == '\0') break;
 
-            // Add a space between lines if needed
-            value[value_len] = ' ';
-            value_len++;
+        if (!in_command) {
+            if (strncmp(p, start_tag, strlen(start_tag)) == 0) {
+                p += strlen(start_tag);
+                command_start = list->text.length;
+                in_command = true;
+                fenced = false;
+            } else {
+                p++;
+            }
+        } else if (strncmp(p, end_tag, strlen(end_tag)) == 0) {
+            if ((size_t)list->count == capacity) {
+                size_t new_capacity = capacity ? capacity * 2 : 4;
+                size_t *grown = realloc(starts, new_capacity * sizeof(size_t));
+                if (grown == NULL) break;
+                starts = grown;
+                capacity = new_capacity;
+            }
+            ok = buffer_append(&list->text, "", 1);
+            starts[list->count++] = command_start;
+            in_command = false;
+            p += strlen(end_tag);
+        } else if (strncmp(p, "```", 3) == 0) {
+            p += 3;
+            for (size_t l = 0; !fenced && l < sizeof(fence_languages) / sizeof(fence_languages[0]); l++) {
+                size_t tag_length = strlen(fence_languages[l]);
+                if (strncmp(p, fence_languages[l], tag_length) == 0) {
+                    p += tag_length;
+                    break;
+                }
+            }
+            fenced = true;
+        } else {
+            ok = buffer_append(&list->text, p, 1);
+            p++;
         }
     }
+    // An unmatched start tag leaves nothing to run
+
+    // The text only stops moving once it is complete
+    if (list->count > 0 && (list->commands = malloc(list->count * sizeof(char *))) == NULL) ok = false;
+    for (int i = 0; ok && i < list->count; i++) list->commands[i] = list->text.data + starts[i];
+    free(starts);
+    if (!ok) {
+        perror("Failed to allocate memory for command");
+        list->count = 0;
+    }
+    return ok;
+}
 
-    // Null-terminate the final value string
-    if (value) value[value_len - 1] = '\0';
+static void command_list_free(CommandList *list) {
+    free(list->commands);
+    buffer_free(&list->text);
+}
 
-    fclose(config_file);
+// Function to find and execute each command in the assistant's response
+int process_response_for_commands(Session *s, const char *response) {
+    // Collect every complete command first, a batch is approved as a whole
+    CommandList list;
+    collect_commands(response, &list);
 
-    if (value == NULL) {
-        fprintf(stderr, "%s not found in config file\n", key_prefix);
+    if (config.cmd_batch && list.count > 1) {
+        execute_command_batch(s, list.commands, list.count);
+    } else {
+        for (int i = 0; i < list.count && !s->ended; i++) {
+            execute_command(s, list.commands[i]);
+        }
     }
 
-    return value;
-}
+    approval_discard(s);
 
-// Wrapper functions for specific keys
-char *get_prompt() {
-    return get_multiline_config_value("PROMPT=");
+    int command_count = list.count;
+    command_list_free(&list);
+    return command_count > 0;
 }
-char *get_added_prompt() {
-    return get_multiline_config_value("ADDEDPROMPT=");
+
+// Function to ask about the first command of a streamed reply as soon as it is in, the transport keeps
+// collecting the rest of the reply meanwhile. A command with a kept result is not asked about at all
+static void ask_approval_early(void *arg, const char *reply) {
+    Session *s = arg;
+    CommandList list;
+    ByteBuffer cached = {0};
+    if (collect_commands(reply, &list) && list.count > 0 && !readonly_cache_reuse(s, list.commands[0], &cached)) {
+        EarlyApproval *early = calloc(1, sizeof(*early));
+        if (early && (early->command = strdup(list.commands[0])) != NULL) {
+            fprintf(s->out, "\n");
+            ask_approval(s, early->command, &early->spec, early->answer, sizeof(early->answer));
+            s->approval = early;
+        } else {
+            free(early);
+        }
+    }
+    buffer_free(&cached);
+    command_list_free(&list);
 }
 
+// Function to run one conversation, returns the exit status for the invocation
+int run_session(Session *s, int argc, char *argv[]) {
 
+    // Build the prompt by joining all arguments with spaces
+    char prompt[RESPONSE_BUFFER_SIZE] = "";
 
-// Conversation array and a count to keep track of entries
-ConversationEntry conversation[MAX_CONVERSATION_ENTRIES];
-int conversation_count = 0;
+    // A resumed conversation already has its prompts, the new request just follows on
+    bool resumed = false;
+    if (s->resume_id) {
+        if (!session_resume(s, s->resume_id)) return 1;
+        resumed = true;
+        fprintf(s->out, "Resumed session %s (%zu messages)\n", s->log.id, s->conversation.count);
+    }
 
-// Function to decode URL-encoded content
-char *url_decode(const char *encoded_str) {
-    CURL *curl = curl_easy_init();
-    char *decoded_str = NULL;
+    // The prompts go in first, in interactive mode that is done before the user starts typing
+    if (!resumed) {
+        if (config.prompt) {
+            append_conversation_entry(s, ROLE_SYSTEM, config.prompt);
+        } else {
+            fprintf(s->err, "PROMPT= not found in config file\n");
+        }
 
-    if (curl) {
-        decoded_str = curl_easy_unescape(curl, encoded_str, 0, NULL);
-        curl_easy_cleanup(curl); // Clean up CURL
+        if (config.added_prompt) {
+            append_conversation_entry(s, ROLE_SYSTEM, config.added_prompt);
+        } else {
+            fprintf(s->err, "ADDEDPROMPT= not found in config file\n");
+        }
     }
 
-    return decoded_str ? decoded_str : strdup(encoded_str); // Return decoded or original if decoding failed
-}
+	// Interactive mode
+	if(argc == 0) {
 
-//Function to add 
+                        fprintf(s->out, "Enter your message: ");
+                        read_user_line(s, prompt, sizeof(prompt));
+                        prompt[strcspn(prompt, "\n")] = '\0'; // Remove newline
 
-void append_conversation_entry(const char *role, const char *content) {
-    if (conversation_count < MAX_CONVERSATION_ENTRIES) {
-        // Store the role as-is
-        strncpy(conversation[conversation_count].role, role, sizeof(conversation[conversation_count].role) - 1);
 
-        // Initialize CURL to use curl_easy_escape
-        CURL *curl = curl_easy_init();
-        if (curl) {
-            // URL-encode the content
-            char *encoded_content = curl_easy_escape(curl, content, 0);
-            if (encoded_content) {
-                // Store the URL-encoded content
-                strncpy(conversation[conversation_count].content, encoded_content, sizeof(conversation[conversation_count].content) - 1);
-                curl_free(encoded_content); // Free encoded content memory
-            } else {
-                // If encoding fails, fall back to the original content
-                strncpy(conversation[conversation_count].content, content, sizeof(conversation[conversation_count].content) - 1);
-            }
-            curl_easy_cleanup(curl); // Clean up CURL
+	} else {
+    for (int i = 0; i < argc; i++) {
+        strncat(prompt, argv[i], sizeof(prompt) - strlen(prompt) - 1);
+        if (i < argc - 1) {
+            strncat(prompt, " ", sizeof(prompt) - strlen(prompt) - 1); // Add space between arguments
         }
-
-        conversation_count++;
-    } else {
-        printf("Conversation storage limit reached.\n");
     }
 }
 
-// function to escape double quotes and actually other special characters so that excecution goes through nicely.
-void escape_double_quotes(const char *input, char *output, size_t output_size) {
-    size_t j = 0; // Index for the output buffer
+    append_conversation_entry(s, ROLE_USER, prompt);
 
-    for (size_t i = 0; input[i] != '\0' && j < output_size - 1; ++i) {
-        if (input[i] == '"') {
-            // Escape double quotes
-            if (j + 1 < output_size - 1) {
-                output[j++] = '\\';
-                output[j++] = '"';
-            } else {
-                break; // No space for escaping, stop to avoid overflow
-            }
-        } else if (input[i] == '\\') {
-            // Escape backslashes
-            if (j + 1 < output_size - 1) {
-                output[j++] = '\\';
-                output[j++] = '\\';
-            } else {
-                break; // No space for escaping, stop to avoid overflow
-            }
-        } else if (input[i] == '$') {
-            // Escape dollar signs
-            if (j + 1 < output_size - 1) {
-                output[j++] = '\\';
-                output[j++] = '$';
-            } else {
-                break; // No space for escaping, stop to avoid overflow
-            }
-        } else if (input[i] == '`') {
-            // Escape backticks
-            if (j + 1 < output_size - 1) {
-                output[j++] = '\\';
-                output[j++] = '`';
-            } else {
-                break; // No space for escaping, stop to avoid overflow
+    // With CMDBATCH the whole reply is needed before anything is asked
+    s->transport.on_command = config.cmd_batch ? NULL : ask_approval_early;
+    s->transport.on_command_arg = s;
+
+    while (!s->ended) {
+
+        // Send conversation history to OpenAI API and display response
+        char *response = send_request_to_openai(s);
+        if (response != NULL) {
+            // Streamed replies are already on screen by now
+            double started = stats_begin(s);
+            char *ai_content = s->stream ? parse_ai_stream_response(s, response) : parse_ai_response(s, response);
+            if (ai_content == NULL) break;
+            stats_end(s, PHASE_PARSE, started, NULL);
+
+            append_conversation_entry(s, ROLE_ASSISTANT, ai_content);
+            if (!s->stream) fprintf(s->out, "%s\n", ai_content);
+
+            int commands_found = process_response_for_commands(s, ai_content);
+
+            if (!commands_found) {
+                // No command found, prompt the sysadmin
+                fprintf(s->out, "Do you want to continue the conversation? (yes/no) [no]: ");
+                char user_input[10];
+                read_user_line(s, user_input, sizeof(user_input));
+
+                // Default to "no" if input is empty or doesn't start with "yes"
+                if (strncmp(user_input, "yes", 3) == 0) {
+                    // Get input for the next user entry
+                    fprintf(s->out, "Enter your next message: ");
+                    char user_message[RESPONSE_BUFFER_SIZE];
+                    read_user_line(s, user_message, sizeof(user_message));
+                    user_message[strcspn(user_message, "\n")] = '\0'; // Remove newline
+
+                    // Append the user's new message to the conversation
+                    append_conversation_entry(s, ROLE_USER, user_message);
+                } else {
+                    end_session(s, 0); // End the conversation
+                }
             }
+
+            free(ai_content);
         } else {
-            // Copy other characters as-is
-            output[j++] = input[i];
+            // Transient failures were already retried, the conversation is kept for another try
+            approval_discard(s);
+            fprintf(s->err, "Failed to get a response from AI.\n");
+            fprintf(s->out, "Do you want to try again? (yes/no) [no]: ");
+            char user_input[10];
+            read_user_line(s, user_input, sizeof(user_input));
+            if (strncmp(user_input, "yes", 3) != 0) end_session(s, 1);
         }
     }
 
-    // Null-terminate the output string
-    output[j] = '\0';
+    fflush(s->out);
+    return s->exit_status;
 }
 
-// Remove backticks
-void strip_triple_backticks(char *response) {
-    char *src = response, *dst = response;
-    while (*src) {
-        // Look for triple backticks
-        if (strncmp(src, "```", 3) == 0) {
-            src += 3; // Skip over the triple backticks
-        } else {
-            *dst++ = *src++; // Copy characters if not part of triple backticks
-        }
+// Function to release everything a session allocated
+void session_cleanup(Session *s) {
+    approval_discard(s);
+    shell_stop(&s->shell, false);
+    transport_cleanup(&s->transport);
+    readonly_cache_clear(&s->readonly);
+    arena_free(&s->conversation.arena);
+    free(s->conversation.entries);
+    free(s->payload.segments);
+    buffer_free(&s->payload_header);
+    free(s->context_plan);
+    summarizer_cleanup(&s->summarizer);
+    session_log_sync(s);
+    if (s->log.open) close(s->log.fd);
+}
+
+// Function to append one message the way a session sends it, escaped for JSON
+static bool batch_append_message(ByteBuffer *out, ConversationRole role, const char *content) {
+    size_t length = strlen(content);
+    bool ok = buffer_printf(out, "{\"role\":\"%s\",\"content\":\"", conversation_role_names[role]) &&
+              buffer_reserve(out, json_escaped_length(content, length));
+    if (ok) {
+        out->length = json_escape(out->data + out->length, content, length) - out->data;
+        ok = buffer_append(out, "\"}", 2);
     }
-    *dst = '\0'; // Null-terminate the cleaned string
+    return ok;
 }
 
-// Function to generate JSON payload from the conversation array
-char *generate_json_payload() {
-    struct json_object *messages_array = json_object_new_array();
+// Function to get the next input line; 1 with a line, 0 when none is ready yet, -1 at the end of the input
+static int batch_next_line(BatchInput *input, char **line) {
+    for (;;) {
+        char *start = input->pending.data ? input->pending.data + input->consumed : NULL;
+        size_t available = input->pending.length - input->consumed;
+        char *newline = start ? memchr(start, '\n', available) : NULL;
 
-    for (int i = 0; i < conversation_count; i++) {
-        struct json_object *message_obj = json_object_new_object();
-        json_object_object_add(message_obj, "role", json_object_new_string(conversation[i].role));
-        json_object_object_add(message_obj, "content", json_object_new_string(conversation[i].content));
-        json_object_array_add(messages_array, message_obj);
-    }
+        if (newline || (input->eof && available > 0)) {
+            size_t length = newline ? (size_t)(newline - start) : available;
+            input->consumed += newline ? length + 1 : length;
+            *line = strndup(start, length);
+            return *line ? 1 : -1;
+        }
+        if (input->eof) return -1;
 
-    struct json_object *payload_obj = json_object_new_object();
-    json_object_object_add(payload_obj, "model", json_object_new_string("gpt-4o"));
-    json_object_object_add(payload_obj, "messages", messages_array);
-    json_object_object_add(payload_obj, "temperature", json_object_new_double(0));
-    json_object_object_add(payload_obj, "max_tokens", json_object_new_int(MAXTOKENS));
+        // Only read when it cannot block, the requests in flight must keep moving
+        struct pollfd pfd = { input->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) <= 0) return 0;
 
-    char *payload_str = strdup(json_object_to_json_string(payload_obj));
-    json_object_put(payload_obj); // Free JSON object memory
-    return payload_str;
+        if (input->consumed > 0) {
+            memmove(input->pending.data, start, available);
+            input->pending.length = available;
+            input->consumed = 0;
+        }
+        if (!buffer_reserve(&input->pending, 65536)) return -1;
+        ssize_t n = read(input->fd, input->pending.data + input->pending.length, 65536);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n <= 0) {
+            input->eof = true;
+        } else {
+            input->pending.length += n;
+            input->pending.data[input->pending.length] = '\0';
+        }
+    }
 }
 
+// Function to pull the prompt out of an input line: a JSON string, or an object with a "prompt"
+static char *batch_parse_prompt(const char *line) {
+    struct json_object *parsed = json_tokener_parse(line);
+    struct json_object *prompt = parsed;
+    char *text = NULL;
 
-// Function to get the OpenAI API key from configuration file
-char *get_api_key() {
-    FILE *config_file = fopen(CONFIG_PATH, "r");
-    if (config_file == NULL) {
-        perror("Failed to open config file");
-        return NULL;
+    if (parsed && json_object_is_type(parsed, json_type_object) && !json_object_object_get_ex(parsed, "prompt", &prompt)) {
+        prompt = NULL;
     }
+    if (prompt && json_object_is_type(prompt, json_type_string)) text = strdup(json_object_get_string(prompt));
+    if (parsed) json_object_put(parsed);
+    return text;
+}
 
-    char *api_key = NULL;
-    char line[256];
+// Function to write one JSONL result, content or error, in completion order
+static void batch_print(long index, long status, int attempts, double ms, const char *content, const char *error) {
+    struct json_object *result = json_object_new_object();
+    json_object_object_add(result, "index", json_object_new_int64(index));
+    if (status) json_object_object_add(result, "status", json_object_new_int((int)status));
+    json_object_object_add(result, "attempts", json_object_new_int(attempts));
+    json_object_object_add(result, "ms", json_object_new_int64((int64_t)(ms + 0.5)));
 
-    while (fgets(line, sizeof(line), config_file)) {
-        // Check if line starts with "OPENAIKEY="
-        if (strncmp(line, "OPENAIKEY=", 10) == 0) {
-            // Allocate memory for the API key
-            api_key = strdup(line + 10); // Copy the key part after "OPENAIKEY="
-            if (api_key == NULL) {
-                perror("Failed to allocate memory for API key");
-                fclose(config_file);
-                return NULL;
-            }
-            // Remove newline character if present
-            char *newline = strchr(api_key, '\n');
-            if (newline) *newline = '\0';
-            break;
+    if (content) {
+        json_object_object_add(result, "content", json_object_new_string(content));
+        CommandList commands;
+        collect_commands(content, &commands);
+        struct json_object *list = json_object_new_array();
+        for (int i = 0; i < commands.count; i++) {
+            json_object_array_add(list, json_object_new_string(commands.commands[i]));
         }
+        command_list_free(&commands);
+        json_object_object_add(result, "commands", list);
+    } else {
+        json_object_object_add(result, "error", json_object_new_string(error ? error : "unknown error"));
     }
 
-    fclose(config_file);
+    printf("%s\n", json_object_to_json_string_ext(result, JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE));
+    fflush(stdout);
+    json_object_put(result);
+}
+
+// Function to describe a failed request: the API's own message when there is one
+static char *batch_error_text(BatchSlot *slot, CURLcode res, long status) {
+    char *text = NULL;
+    if (res != CURLE_OK) return strdup(curl_easy_strerror(res));
 
-    if (api_key == NULL) {
-        fprintf(stderr, "API key not found in config file\n");
+    struct json_object *parsed = slot->response.data ? json_tokener_parse(slot->response.data) : NULL;
+    struct json_object *error, *message;
+    if (parsed && json_object_object_get_ex(parsed, "error", &error) &&
+        json_object_object_get_ex(error, "message", &message)) {
+        text = strdup(json_object_get_string(message));
     }
+    if (parsed) json_object_put(parsed);
+    if (text == NULL && asprintf(&text, "HTTP status %ld", status) < 0) text = NULL;
+    return text;
+}
 
-    return api_key;
+static void batch_send(CURLM *multi, BatchSlot *slot) {
+    slot->response.length = 0;
+    slot->attempts++;
+    slot->active = true;
+    curl_easy_setopt(slot->curl, CURLOPT_POSTFIELDS, slot->body.data);
+    curl_easy_setopt(slot->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)slot->body.length);
+    curl_multi_add_handle(multi, slot->curl);
 }
 
-// Function to send request to OpenAI API and get response
-char *send_request_to_openai(char *api_key) {
-
-    char *json_payload = generate_json_payload();
-    static char response[RESPONSE_BUFFER_SIZE];
-
-    char command[COMMAND_BUFFER_SIZE];
-    snprintf(command, sizeof(command),
-             "curl -s -X POST https://api.openai.com/v1/chat/completions "
-             "-H \"Content-Type: application/json\" "
-             "-H \"Authorization: Bearer %s\" "
-             "-d '%s'", api_key, json_payload);
-
-    FILE *fp = popen(command, "r");
-    if (fp == NULL) {
-        perror("Error sending request to OpenAI");
-        free(json_payload);
-        return NULL;
+// Function to answer every line of FILE (- for stdin) as its own conversation, all of them on one
+// curl_multi loop. BATCHCONCURRENCY caps the requests in flight; a 429 halves the cap and holds new
+// requests back for Retry-After, the cap grows back by one every time that many requests succeeded
+int run_batch(const char *path, const Backend *backend) {
+    BatchInput input = { .fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_CLOEXEC) };
+    if (input.fd < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return 1;
     }
 
-    fread(response, sizeof(char), RESPONSE_BUFFER_SIZE, fp);
-    pclose(fp);
-    free(json_payload);
-
-    return response;
-}
+    long cap = config.batch_concurrency;
+    BatchSlot *slots = calloc(cap, sizeof(BatchSlot));
+    CURLM *multi = curl_multi_init();
+    struct curl_slist *headers = backend_headers(backend, false);
+    ByteBuffer prefix = {0};
 
-// Process the JSON response and extract the "content" field from "choices"
-char *parse_ai_response(const char *json_response) {
-    struct json_object *parsed_json, *choices_array, *choice, *message, *content;
+    // Settings and system prompts are the same for every line, they are serialized once
+    bool ok = slots && multi && headers;
+    for (long i = 0; ok && i < cap; i++) ok = (slots[i].curl = curl_easy_init()) != NULL;
+    ok = ok && backend_apis[backend->api].payload_header(&prefix, backend, false, config.max_tokens, config.temperature);
+    if (ok && config.prompt) {
+        ok = batch_append_message(&prefix, ROLE_SYSTEM, config.prompt) && buffer_append(&prefix, ",", 1);
+    }
+    if (ok && config.added_prompt) {
+        ok = batch_append_message(&prefix, ROLE_SYSTEM, config.added_prompt) && buffer_append(&prefix, ",", 1);
+    }
+    if (!ok) fprintf(stderr, "Failed to set up the batch\n");
 
-    // Parse the JSON string
-    parsed_json = json_tokener_parse(json_response);
-    if (parsed_json == NULL) {
-        printf("%s\n", json_response);
-	printf("\nAI ended the conversation.\n");
-        exit(1);
-        return NULL;
+    for (long i = 0; ok && i < cap; i++) {
+        CURL *curl = slots[i].curl;
+        curl_easy_setopt(curl, CURLOPT_URL, backend->endpoint);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, buffer_write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &slots[i].response);
+        curl_easy_setopt(curl, CURLOPT_PRIVATE, &slots[i]);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, backend->connect_timeout);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, backend->request_timeout);
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
     }
+    if (multi) curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, cap);
+
+    long limit = cap, successes = 0, active = 0, waiting = 0, done = 0, failed = 0, retries = 0;
+    double paused_until = 0, batch_started = monotonic_ms();
+    bool input_done = false;
+    while (ok) {
+        double now = monotonic_ms();
+        bool paused = now < paused_until;
+
+        // Retries first, then fresh lines, as far as the cap and a 429 pause allow
+        for (long i = 0; i < cap && !paused && active < limit; i++) {
+            if (slots[i].waiting && slots[i].retry_at <= now) {
+                slots[i].waiting = false;
+                waiting--;
+                active++;
+                batch_send(multi, &slots[i]);
+            }
+        }
+        for (long i = 0; i < cap && !paused && active < limit && !input_done; i++) {
+            BatchSlot *slot = &slots[i];
+            if (slot->active || slot->waiting) continue;
+
+            char *line;
+            int got = batch_next_line(&input, &line);
+            input_done = got < 0;
+            if (got <= 0) break;
+            long index = input.lines++;
+            if (line[strspn(line, " \t\r")] == '\0') {
+                free(line);
+                i--;
+                continue; // blank lines keep their number but are not answered
+            }
+
+            char *prompt = batch_parse_prompt(line);
+            free(line);
+            slot->body.length = 0;
+            if (prompt == NULL || !buffer_append(&slot->body, prefix.data, prefix.length) ||
+                !batch_append_message(&slot->body, ROLE_USER, prompt) || !buffer_append(&slot->body, "]}", 2)) {
+                batch_print(index, 0, 0, 0, NULL, prompt ? "out of memory" : "line is not a JSON string or an object with a \"prompt\"");
+                failed++;
+                free(prompt);
+                i--;
+                continue;
+            }
+            free(prompt);
+
+            slot->index = index;
+            slot->attempts = 0;
+            slot->started = now;
+            active++;
+            batch_send(multi, slot);
+        }
+
+        if (input_done && active == 0 && waiting == 0) break;
+
+        int running;
+        curl_multi_perform(multi, &running);
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            BatchSlot *slot;
+            CURLcode res = msg->data.result;
+            long status = 0;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&slot);
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+            curl_multi_remove_handle(multi, slot->curl);
+            slot->active = false;
+            active--;
+            now = monotonic_ms();
+
+            char *content = res == CURLE_OK && status == 200 ? extract_message_content(backend, slot->response.data) : NULL;
+            bool retryable = content == NULL && (res != CURLE_OK || status == 429 || status >= 500);
+            if (retryable && slot->attempts <= config.batch_retries) {
+                double delay = retry_delay_ms(slot->curl, slot->attempts);
+
+                slot->waiting = true;
+                slot->retry_at = now + delay;
+                waiting++;
+                retries++;
+                if (status == 429) {
+                    if (slot->retry_at > paused_until) paused_until = slot->retry_at;
+                    limit = limit > 1 ? limit / 2 : 1;
+                    successes = 0;
+                }
+                continue;
+            }
+
+            if (content) {
+                batch_print(slot->index, status, slot->attempts, now - slot->started, content, NULL);
+                free(content);
+                done++;
+                if (limit < cap && ++successes >= limit) {
+                    limit++;
+                    successes = 0;
+                }
+            } else {
+                char *error = batch_error_text(slot, res, status);
+                batch_print(slot->index, status, slot->attempts, now - slot->started, NULL, error);
+                free(error);
+                failed++;
+            }
+        }
 
-    // Navigate through the JSON structure to reach "content"
-    if (json_object_object_get_ex(parsed_json, "choices", &choices_array)) {
-        choice = json_object_array_get_idx(choices_array, 0);
-        if (json_object_object_get_ex(choice, "message", &message) &&
-            json_object_object_get_ex(message, "content", &content)) {
-            // Return the content as a string
-            const char *content_str = json_object_get_string(content);
-            char *decoded_content = url_decode(content_str);
-            //char *result = strdup(content_str);
+        if (input_done && active == 0 && waiting == 0) break;
 
-            json_object_put(parsed_json);
-            return decoded_content;
+        // Sleep until a transfer or the input needs us, or the next retry or the end of a pause is due
+        double wake = now + 1000;
+        for (long i = 0; i < cap; i++) {
+            if (slots[i].waiting && slots[i].retry_at < wake) wake = slots[i].retry_at;
         }
+        if (paused && paused_until < wake) wake = paused_until;
+        struct curl_waitfd input_wait = { input.fd, CURL_WAIT_POLLIN, 0 };
+        bool want_input = !input.eof && !paused && active < limit;
+        bool lines_ready = !input_done && !paused && active < limit && input.consumed < input.pending.length;
+        int timeout = wake > now && !lines_ready ? (int)(wake - now) + 1 : 0;
+        curl_multi_poll(multi, want_input ? &input_wait : NULL, want_input ? 1 : 0, timeout, NULL);
     }
 
-    // Clean up if parsing failed
-    json_object_put(parsed_json);
-    printf("%s\n", json_response);
-    printf("\nAI ended the conversation.\n");
-    exit(1);
+    fprintf(stderr, "Batch: %ld answered, %ld failed, %ld retries in %.1fs\n", done, failed, retries,
+            (monotonic_ms() - batch_started) / 1000);
 
-    return NULL;
+    for (long i = 0; slots && i < cap; i++) {
+        if (slots[i].curl) {
+            if (slots[i].active) curl_multi_remove_handle(multi, slots[i].curl);
+            curl_easy_cleanup(slots[i].curl);
+        }
+        buffer_free(&slots[i].body);
+        buffer_free(&slots[i].response);
+    }
+    if (multi) curl_multi_cleanup(multi);
+    curl_slist_free_all(headers);
+    free(slots);
+    buffer_free(&prefix);
+    buffer_free(&input.pending);
+    if (input.fd != STDIN_FILENO) close(input.fd);
+    return ok && failed == 0 ? 0 : 1;
 }
 
-// If necessary remove these annoying backslashes (not in use right now)
-void remove_extra_backslashes(char *str) {
-    int i, j = 0;
-    int len = strlen(str);
-    char result[len + 1]; // Temporary array to store the modified string
-
-    for (i = 0; i < len; i++) {
-        if (str[i] == '\\' && str[i + 1] == '\\') {
-            // Keep only one backslash
-            result[j++] = '\\';
-            i++; // Skip the next backslash
-        } else if (str[i] == '\\' && (str[i + 1] == '\"' || str[i + 1] == '\'')) {
-            // Remove unnecessary backslashes before quotes
-            result[j++] = str[i + 1];
-            i++; // Skip the next character
+// Function to parse the leading --options, returns the index of the first prompt word or -1
+int parse_options(int argc, char *argv[], Options *opts, FILE *err) {
+    int i = 1;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        const char *opt = argv[i++];
+        if (strcmp(opt, "--") == 0) {
+            break; // Everything after is the prompt
+        } else if (strcmp(opt, "--stream") == 0) {
+            opts->stream = opts->stream_set = true;
+        } else if (strcmp(opt, "--no-stream") == 0) {
+            opts->stream = false;
+            opts->stream_set = true;
+        } else if (strcmp(opt, "--daemon") == 0) {
+            opts->daemon = true;
+        } else if (strcmp(opt, "--no-daemon") == 0) {
+            opts->no_daemon = true;
+        } else if (strcmp(opt, "--cache-stats") == 0) {
+            opts->cache_stats = true;
+        } else if (strcmp(opt, "--stats") == 0) {
+            opts->stats = true;
+        } else if (strcmp(opt, "--trace") == 0 && i < argc) {
+            opts->trace_path = argv[i++];
+        } else if (strcmp(opt, "--batch") == 0 && i < argc) {
+            opts->batch_path = argv[i++];
+        } else if (strcmp(opt, "--backend") == 0 && i < argc) {
+            opts->backend = argv[i++];
+        } else if (strcmp(opt, "--resume") == 0 && i < argc) {
+            opts->resume_id = argv[i++];
+        } else if (strcmp(opt, "--list") == 0) {
+            opts->list_sessions = true;
+        } else if (strcmp(opt, "--prune") == 0) {
+            opts->prune_sessions = true;
+            opts->prune_days = SESSION_PRUNE_DAYS;
+            char *end;
+            double days = i < argc ? strtod(argv[i], &end) : 0;
+            if (i < argc && end != argv[i] && *end == '\0' && days > 0) {
+                opts->prune_days = days;
+                i++;
+            }
         } else {
-            result[j++] = str[i];
+            fprintf(err, "Unknown option: %s\n", opt);
+            return -1;
         }
     }
-    result[j] = '\0'; // Null-terminate the result string
-    strcpy(str, result); // Copy the result back to the original string
+    return i;
 }
 
-// Execute the command on the shell through bash -c 
-void execute_command(char *command, char *command_output, size_t output_size) {
-    int pipe_fd[2];
-    if (pipe(pipe_fd) == -1) {
-        perror("Pipe failed");
-        return;
+// Function to pick the backend for this run: --backend, then BACKEND=, then the top of ai.conf
+static const Backend *select_backend(const Options *opts, FILE *err) {
+    const char *name = opts->backend ? opts->backend : config.backend ? config.backend : "default";
+    const Backend *backend = config_backend(&config, name);
+    if (backend == NULL) {
+        fprintf(err, "Unknown backend: %s\n", name);
+        return NULL;
+    }
+    // Only the OpenAI API itself insists on a key, local servers usually take none
+    if (backend->api_key == NULL && backend->api == API_OPENAI && strcmp(backend->endpoint, OPENAI_API_URL) == 0) {
+        fprintf(err, "API key not found in config file\n");
+        fprintf(err, "Could not retrieve API key.\n");
+        return NULL;
     }
+    return backend;
+}
 
-    // Prepare a sanitized command by preserving necessary backslashes
-    char sanitized_command[548];
-    char re_sanitized_command[512];
+bool send_frame(int fd, char type, const void *data, uint32_t length) {
+    char header[5];
+    header[0] = type;
+    memcpy(header + 1, &length, sizeof(length));
 
-//    remove_extra_backslashes(command);
-    escape_double_quotes(command, re_sanitized_command, sizeof(re_sanitized_command));
+    struct iovec iov[2] = { { header, sizeof(header) }, { (void *)data, length } };
+    size_t total = sizeof(header) + length;
+    ssize_t n;
+    do {
+        n = writev(fd, iov, length ? 2 : 1);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return false;
+    if ((size_t)n == total) return true;
 
-    snprintf(sanitized_command, sizeof(sanitized_command), "bash -c \"%s\"", re_sanitized_command);
+    // Short write, finish the rest the slow way
+    if ((size_t)n < sizeof(header)) {
+        return write_full(fd, header + n, sizeof(header) - n) && write_full(fd, data, length);
+    }
+    return write_full(fd, (const char *)data + (n - sizeof(header)), total - n);
+}
 
-    printf("I need to run this command: %s\n", sanitized_command);
-    printf("Do you want to proceed? (yes/no/exit) [no]: ");
+static bool recv_frame_header(int fd, char *type, uint32_t *length) {
+    char header[5];
+    if (!read_full(fd, header, sizeof(header))) return false;
+    *type = header[0];
+    memcpy(length, header + 1, sizeof(*length));
+    return true;
+}
 
-    char user_input[10];
-    fgets(user_input, sizeof(user_input), stdin);
+// Function to find the daemon socket: $AI_SOCKET, then $XDG_RUNTIME_DIR/ai.sock, then /tmp/ai-<uid>.sock
+static bool daemon_socket_path(struct sockaddr_un *addr) {
+    const char *path = getenv("AI_SOCKET");
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
 
-    // Default to "no" if input is empty or doesn't start with "yes" or "exit"
-    if (strncmp(user_input, "yes", 3) == 0) {
-        pid_t pid = fork();
-        if (pid == -1) {
-            perror("Failed to fork");
-            return;
-        } else if (pid == 0) {
-            // Child process: executes the command and writes output to the pipe
-            close(pipe_fd[0]);  // Close the read end of the pipe
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    int n;
+    if (path && path[0]) {
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+    } else if (runtime_dir && runtime_dir[0]) {
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/ai.sock", runtime_dir);
+    } else {
+        n = snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/ai-%d.sock", (int)getuid());
+    }
+    return n > 0 && (size_t)n < sizeof(addr->sun_path);
+}
 
-            char line[512];
-            char result[RESPONSE_BUFFER_SIZE+PADDING] = "";
+// Function to find the config a run of ai loads: $AI_CONFIG, make bench points it at its mock server, or ai.conf
+static const char *config_file_path(void) {
+    const char *path = getenv("AI_CONFIG");
+    return path && *path ? path : CONFIG_PATH;
+}
 
-            FILE *fp = popen(sanitized_command, "r");
-            if (fp == NULL) {
-                perror("Error executing command");
-                exit(1);
-            }
+// Function to tell which file and which version of it path is, all zeroes when it cannot be read
+static void config_identity(const char *path, ConfigIdentity *id) {
+    struct stat st;
+    memset(id, 0, sizeof(*id));
+    if (stat(path, &st) != 0) return;
+    *id = (ConfigIdentity){ st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+}
 
-            while (fgets(line, sizeof(line), fp) != NULL) {
-                if (strlen(result) + strlen(line) < RESPONSE_BUFFER_SIZE - 512) {
-                    strcat(result, line);
-                } else {
-                    printf("\n\nOutput buffer exceeded so we truncate.\n");
-                    break;
-                }
-            }
+// The config the daemon loaded at its start, clients expecting another one or a newer one are sent back
+static ConfigIdentity daemon_config;
 
-            pclose(fp);
+// Function to make sure the other end of the socket runs as the same user
+static bool peer_is_same_user(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
 
+// stdio cookie callbacks: writes become frames, reads come from the client's stdin frames
+static ssize_t frame_stream_write(void *cookie, const char *buf, size_t size) {
+    FrameStream *fs = cookie;
+    return send_frame(fs->fd, fs->type, buf, (uint32_t)size) ? (ssize_t)size : -1;
+}
 
-            // Write the result to the pipe
-            write(pipe_fd[1], result, strlen(result) + 1);
-            write(pipe_fd[1], "\n\nOutput buffer exceeded so we truncate.\n", strlen("\n\nOutput buffer exceeded so we truncate.\n")+1);
-            close(pipe_fd[1]); // Close write end of pipe
-            exit(0);           // Exit child process
+static ssize_t frame_stream_read(void *cookie, char *buf, size_t size) {
+    FrameStream *fs = cookie;
 
+    while (fs->pending == 0) {
+        char type;
+        uint32_t length;
+        if (fs->eof || !recv_frame_header(fs->fd, &type, &length) || type == FRAME_STDIN_EOF) {
+            fs->eof = true;
+            return 0;
+        }
+        if (type == FRAME_STDIN) {
+            fs->pending = length;
         } else {
-            // Parent process: waits with a timeout
-            close(pipe_fd[1]); // Close the write end of the pipe
-
-            int status;
-            int timeout = 60; // 60 seconds timeout
-            while (timeout > 0) {
-                pid_t result = waitpid(pid, &status, WNOHANG);
-                if (result == 0) { // Child still running
-                    sleep(1);
-                    timeout--;
-                } else if (result == pid) { // Child finished
-                    break;
-                } else { // Error occurred
-                    perror("Error waiting for child process");
-                    break;
+            // Nothing else is expected mid-session, drop it
+            char scratch[512];
+            while (length > 0) {
+                uint32_t n = length < sizeof(scratch) ? length : sizeof(scratch);
+                if (!read_full(fs->fd, scratch, n)) {
+                    fs->eof = true;
+                    return 0;
                 }
+                length -= n;
             }
+        }
+    }
 
-            if (timeout == 0) {
-                printf("Command timed out. Killing process.\n");
-                kill(pid, SIGKILL);
-                waitpid(pid, &status, 0); // Clean up the terminated process
-                snprintf(command_output, output_size, "command executed: <%s> status: <timeout>", command);
-            } else if (WIFEXITED(status)) {
-                // Read from the pipe to get command output from the child process
-                read(pipe_fd[0], command_output, output_size - 1);
-                command_output[output_size - 1] = '\0';  // Ensure null termination
+    ssize_t n;
+    do {
+        n = read(fs->fd, buf, size < fs->pending ? size : fs->pending);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        fs->eof = true;
+        return 0;
+    }
+    fs->pending -= n;
+    return n;
+}
 
-                if (strlen(command_output) == 0) {
-                    snprintf(command_output, output_size, "command executed: <%s> status: <executed> output: <Empty or Execution error>", command);
-                } else {
-                    char full_output[RESPONSE_BUFFER_SIZE+PADDING]="";
-                    snprintf(full_output, RESPONSE_BUFFER_SIZE, "command executed: <%s> status: <executed> output: <%s>", command, command_output);
-                    strncpy(command_output, full_output, output_size - 1);
-                    command_output[output_size - 1] = '\0'; // Null-terminate the result
-                }
-            }
-            close(pipe_fd[0]); // Close read end of pipe
-            printf("Command output:\n%s\n", command_output);
-            append_conversation_entry("user", command_output);
+static int frame_stream_close(void *cookie) {
+    return 0;
+}
+
+// Function to serve one client connection on a daemon worker
+static void daemon_serve_client(int fd) {
+    if (!peer_is_same_user(fd)) {
+        fprintf(stderr, "Rejected a connection from another user\n");
+        return;
+    }
+
+    // Handshake: the client's cwd, config, environment and argv, then the session starts
+    char **args = calloc(2, sizeof(char *));
+    int arg_count = 1;
+    char **env = calloc(1, sizeof(char *));
+    int env_count = 0;
+    char *cwd = NULL;
+    ConfigIdentity client_config;
+    bool has_config = false, started = false;
+    if (args) args[0] = "ai";
+
+    while (args && env && !started) {
+        char type;
+        uint32_t length;
+        if (!recv_frame_header(fd, &type, &length) || length > DAEMON_FRAME_MAX) break;
+
+        char *data = malloc(length + 1);
+        if (data == NULL || !read_full(fd, data, length)) {
+            free(data);
+            break;
         }
-    } else if (strncmp(user_input, "exit", 4) == 0) {
-        printf("Bye Bye!\n");
-        exit(0); // Exit the program immediately
-    } else {
-        snprintf(command_output, output_size, "command executed: <%s> status: <sysadmin declined to execute command.>", command);
-        append_conversation_entry("user", command_output);
-        printf("Do you want to continue the conversation? (yes/no) [no]: ");
-
-        fgets(user_input, sizeof(user_input), stdin);
-        if (strncmp(user_input, "yes", 3) == 0) {
-            printf("Enter your next message: ");
-            char user_message[RESPONSE_BUFFER_SIZE];
-            fgets(user_message, sizeof(user_message), stdin);
-            user_message[strcspn(user_message, "\n")] = '\0';
-            append_conversation_entry("user", user_message);
+        data[length] = '\0';
+
+        if (type == FRAME_ARG) {
+            char **new_args = realloc(args, (arg_count + 2) * sizeof(char *));
+            if (new_args == NULL) {
+                free(data);
+                break;
+            }
+            args = new_args;
+            args[arg_count++] = data;
+            args[arg_count] = NULL;
+        } else if (type == FRAME_ENV) {
+            char **new_env = realloc(env, (env_count + 2) * sizeof(char *));
+            if (new_env == NULL) {
+                free(data);
+                break;
+            }
+            env = new_env;
+            env[env_count++] = data;
+            env[env_count] = NULL;
+        } else if (type == FRAME_CONFIG && length >= sizeof(client_config)) {
+            memcpy(&client_config, data, sizeof(client_config));
+            has_config = true;
+            free(data);
+        } else if (type == FRAME_CWD) {
+            free(cwd);
+            cwd = data;
         } else {
-            printf("Bye Bye!\n");
-            exit(0);
+            started = type == FRAME_START;
+            free(data);
         }
     }
-}
-
-// Function to find and execute each command in the assistant's response
-int process_response_for_commands(const char *response) {
 
-    const char *start_tag = "<CMD>";
-    const char *end_tag = "</CMD>";
-    char *command_start = strstr(response, start_tag);
-    int command_found = 0; // Track if any commands are found
+    // The config is global to the daemon, so a client expecting another file, or an edited one, runs ai itself
+    if (started && (!has_config || memcmp(&client_config, &daemon_config, sizeof(daemon_config)) != 0)) {
+        const char *reason = has_config && client_config.dev == daemon_config.dev && client_config.ino == daemon_config.ino
+                                 ? "The config changed since the ai daemon started, restart it to use the new one\n"
+                                 : "";
+        send_frame(fd, FRAME_REFUSE, reason, strlen(reason));
+        started = false;
+    }
+    started = started && send_frame(fd, FRAME_ACCEPT, NULL, 0);
 
+    FrameStream in_stream = { fd, FRAME_STDIN, 0, false };
+    FrameStream out_stream = { fd, FRAME_STDOUT, 0, false };
+    FrameStream err_stream = { fd, FRAME_STDERR, 0, false };
+    cookie_io_functions_t io = { frame_stream_read, frame_stream_write, NULL, frame_stream_close };
 
-    while (command_start != NULL) {
-        command_found = 1; // Mark that at least one command is found
+    FILE *in = started ? fopencookie(&in_stream, "r", io) : NULL;
+    FILE *out = started ? fopencookie(&out_stream, "w", io) : NULL;
+    FILE *err = started ? fopencookie(&err_stream, "w", io) : NULL;
 
-        // Move the pointer to the start of the actual command (after the start tag)
-        command_start += strlen(start_tag);
+    if (in && out && err) {
+        setvbuf(out, NULL, _IOLBF, 0);
+        setvbuf(err, NULL, _IONBF, 0);
 
-        // Find the end of the command using the end tag
-        char *command_end = strstr(command_start, end_tag);
-        if (command_end == NULL) {
-           // printf("Error: Unmatched command tags.\n");
-            return 0; // Exit if there's an unmatched tag
+        Options opts = {0};
+        const Backend *backend;
+        int status = 1;
+        int first_arg = parse_options(arg_count, args, &opts, err);
+        if (first_arg >= 0 && (opts.daemon || opts.batch_path)) {
+            fprintf(err, "%s cannot be forwarded to a running daemon\n", opts.daemon ? "--daemon" : "--batch");
+        } else if (first_arg >= 0 && (backend = select_backend(&opts, err)) != NULL) {
+            Session session = { .in = in, .out = out, .err = err, .cwd = cwd, .env = env, .resume_id = opts.resume_id,
+                                .backend = backend };
+            session.stream = opts.stream_set ? opts.stream : config.stream;
+            stats_open(&session, &opts, monotonic_ms());
+            status = run_session(&session, arg_count - first_arg, args + first_arg);
+            stats_finish(&session);
+            session_cleanup(&session);
         }
 
-        // Extract the command between the tags
-        size_t command_length = command_end - command_start;
-        char command[512];
-        strncpy(command, command_start, command_length);
-        command[command_length] = '\0'; // Null-terminate the command string
+        fflush(out);
+        int32_t exit_status = status;
+        send_frame(fd, FRAME_EXIT, &exit_status, sizeof(exit_status));
+    }
+
+    if (in) fclose(in);
+    if (out) fclose(out);
+    if (err) fclose(err);
+    for (int i = 1; i < arg_count; i++) free(args[i]);
+    free(args);
+    for (int i = 0; i < env_count; i++) free(env[i]);
+    free(env);
+    free(cwd);
+}
+
+static ClientQueue client_queue = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
 
-        // Buffer to store the output of each command
-        char command_output[RESPONSE_BUFFER_SIZE];
-        char error_output[RESPONSE_BUFFER_SIZE];
-        
-        // Execute the extracted command and capture the output
-        execute_command(command, command_output, sizeof(command_output));
+// Worker thread: takes accepted clients off the queue, one session at a time
+static void *daemon_worker(void *arg) {
+    ClientQueue *queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0) pthread_cond_wait(&queue->not_empty, &queue->lock);
+        int fd = queue->fds[queue->head];
+        queue->head = (queue->head + 1) % DAEMON_QUEUE_SIZE;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
 
-        // Look for the next command in the response
-        command_start = strstr(command_end + strlen(end_tag), start_tag);
+        daemon_serve_client(fd);
+        close(fd);
     }
+    return NULL;
+}
+
+static volatile sig_atomic_t daemon_stop;
 
-    return command_found;
+static void daemon_signal_handler(int sig) {
+    daemon_stop = 1;
 }
 
-// main program
+// Daemon mode: keep the config and connections warm and serve clients over a Unix socket
+int run_daemon(const char *config_path) {
+    struct sockaddr_un addr;
+    if (!daemon_socket_path(&addr)) {
+        fprintf(stderr, "Daemon socket path is too long\n");
+        return 1;
+    }
+    if (!transport_share_init()) {
+        fprintf(stderr, "Failed to initialize libcurl share handle\n");
+        return 1;
+    }
 
-int main(int argc, char *argv[]) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("Failed to create daemon socket");
+        return 1;
+    }
 
-    char *api_key = get_api_key();
-    if (api_key == NULL) {
-        fprintf(stderr, "Could not retrieve API key.\n");
+    // A socket file nobody answers on is left over from a previous daemon
+    if (connect(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "An ai daemon is already listening on %s\n", addr.sun_path);
+        close(listen_fd);
         return 1;
     }
+    close(listen_fd);
+    unlink(addr.sun_path);
 
-    // Build the prompt by joining all arguments with spaces
-    char prompt[RESPONSE_BUFFER_SIZE] = "";
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old_umask = umask(077);
+    int rc = listen_fd < 0 ? -1 : bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (rc != 0 || listen(listen_fd, DAEMON_QUEUE_SIZE) != 0) {
+        perror("Failed to listen on daemon socket");
+        if (listen_fd >= 0) close(listen_fd);
+        return 1;
+    }
 
-	// Interactive mode
-	if(argc<2) {
+    config_identity(config_path, &daemon_config);
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-                        printf("Enter your message: ");
-                        fgets(prompt, sizeof(prompt), stdin);
-                        prompt[strcspn(prompt, "\n")] = '\0'; // Remove newline
+    for (long i = 0; i < config.daemon_workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, daemon_worker, &client_queue) != 0) {
+            perror("Failed to start daemon worker");
+            close(listen_fd);
+            unlink(addr.sun_path);
+            return 1;
+        }
+        pthread_detach(thread);
+    }
 
+    printf("ai daemon listening on %s with %ld workers\n", addr.sun_path, config.daemon_workers);
+    fflush(stdout);
 
-	} else {
-    for (int i = 1; i < argc; i++) {
-        strcat(prompt, argv[i]);
-        if (i < argc - 1) {
-            strcat(prompt, " "); // Add space between arguments
+    while (!daemon_stop) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR) perror("Failed to accept client");
+            continue;
         }
+
+        pthread_mutex_lock(&client_queue.lock);
+        while (client_queue.count == DAEMON_QUEUE_SIZE) pthread_cond_wait(&client_queue.not_full, &client_queue.lock);
+        client_queue.fds[(client_queue.head + client_queue.count) % DAEMON_QUEUE_SIZE] = fd;
+        client_queue.count++;
+        pthread_cond_signal(&client_queue.not_empty);
+        pthread_mutex_unlock(&client_queue.lock);
     }
+
+    close(listen_fd);
+    unlink(addr.sun_path);
+    printf("ai daemon stopped\n");
+    return 0;
 }
 
-    char *config_prompt = get_prompt();
-    char *added_prompt = get_added_prompt();
+// Function to hand the invocation to a running daemon, returns false when there is none to talk to
+// or it runs with another config than this process would load
+bool daemon_client(int argc, char *argv[], int *exit_status) {
+    struct sockaddr_un addr;
+    if (!daemon_socket_path(&addr)) return false;
 
- if (config_prompt) {
-        append_conversation_entry("system", config_prompt);
-        free(config_prompt); // Free memory after use
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+    if (!peer_is_same_user(fd)) {
+        fprintf(stderr, "Ignoring ai daemon socket %s owned by another user\n", addr.sun_path);
+        close(fd);
+        return false;
     }
 
-    if (added_prompt) {
-        append_conversation_entry("system", added_prompt);
-        free(added_prompt); // Free memory after use
+    signal(SIGPIPE, SIG_IGN);
+
+    // Commands run with this process's environment, the daemon's own is not the caller's
+    char cwd[4096];
+    ConfigIdentity id;
+    config_identity(config_file_path(), &id);
+    bool ok = getcwd(cwd, sizeof(cwd)) == NULL || send_frame(fd, FRAME_CWD, cwd, strlen(cwd));
+    ok = ok && send_frame(fd, FRAME_CONFIG, &id, sizeof(id));
+    for (char **var = environ; ok && *var; var++) {
+        ok = send_frame(fd, FRAME_ENV, *var, strlen(*var));
+    }
+    for (int i = 1; ok && i < argc; i++) {
+        ok = send_frame(fd, FRAME_ARG, argv[i], strlen(argv[i]));
     }
+    ok = ok && send_frame(fd, FRAME_START, NULL, 0);
 
-    append_conversation_entry("user", prompt);
+    // Nothing is read from stdin before the daemon took the session, a refused one runs here on the same input
+    char type = 0;
+    uint32_t length = 0;
+    if (!ok || !recv_frame_header(fd, &type, &length) || type != FRAME_ACCEPT) {
+        char reason[256];
+        if (ok && type == FRAME_REFUSE && length < sizeof(reason) && read_full(fd, reason, length)) {
+            fprintf(stderr, "%.*s", (int)length, reason);
+        }
+        close(fd);
+        return false;
+    }
 
-    char command_output[RESPONSE_BUFFER_SIZE];
-    int continue_conversation = 1;
+    // Pump stdin to the daemon and its output back until it reports the exit status
+    bool stdin_open = true;
+    char buf[16384];
+    *exit_status = 1;
+    while (ok) {
+        struct pollfd fds[2] = { { fd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 } };
+        if (poll(fds, stdin_open ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
 
-    while (continue_conversation) {
+        if (stdin_open && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+            if (n > 0) {
+                ok = send_frame(fd, FRAME_STDIN, buf, (uint32_t)n);
+            } else if (n == 0 || errno != EINTR) {
+                ok = send_frame(fd, FRAME_STDIN_EOF, NULL, 0);
+                stdin_open = false;
+            }
+        }
 
-        // Send conversation history to OpenAI API and display response
-        char *response = send_request_to_openai(api_key);
-        if (response != NULL) {
-            char *ai_content = parse_ai_response(response);
-            if (ai_content != NULL) {
-                append_conversation_entry("assistant", ai_content);
-                printf("%s\n", ai_content);
-
-                int commands_found = process_response_for_commands(ai_content);
-
-                if (!commands_found) {
-                    // No command found, prompt the sysadmin
-                    printf("Do you want to continue the conversation? (yes/no) [no]: ");
-                    char user_input[10];
-                    fgets(user_input, sizeof(user_input), stdin);
-
-                    // Default to "no" if input is empty or doesn't start with "yes"
-                    if (strncmp(user_input, "yes", 3) == 0) {
-                        // Get input for the next user entry
-                        printf("Enter your next message: ");
-                        char user_message[RESPONSE_BUFFER_SIZE];
-                        fgets(user_message, sizeof(user_message), stdin);
-                        user_message[strcspn(user_message, "\n")] = '\0'; // Remove newline
-
-                        // Append the user's new message to the conversation
-                        append_conversation_entry("user", user_message);
-                    } else {
-                        continue_conversation = 0; // End the program
-                    }
-                }
+        if (ok && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (!recv_frame_header(fd, &type, &length)) {
+                fprintf(stderr, "Lost connection to the ai daemon\n");
+                break;
+            }
+            if (type == FRAME_EXIT) {
+                int32_t status = 1;
+                if (length == sizeof(status)) read_full(fd, &status, sizeof(status));
+                *exit_status = status;
+                break;
+            }
 
-                free(ai_content);
+            int out_fd = type == FRAME_STDERR ? STDERR_FILENO : STDOUT_FILENO;
+            while (ok && length > 0) {
+                uint32_t n = length < sizeof(buf) ? length : sizeof(buf);
+                ok = read_full(fd, buf, n);
+                if (ok && (type == FRAME_STDOUT || type == FRAME_STDERR)) write_full(out_fd, buf, n);
+                length -= n;
             }
-        } else {
-            fprintf(stderr, "Failed to get a response from AI.\n");
-            break;
         }
     }
 
-    return 0;
+    close(fd);
+    return true;
 }
 
+// main program
+
+// bench/microbench.c builds everything above into its own driver
+#ifndef AI_NO_MAIN
+int main(int argc, char *argv[]) {
+    double started = monotonic_ms();
+
+    Options opts = {0};
+    int first_arg = parse_options(argc, argv, &opts, stderr);
+    if (first_arg < 0) return 1;
+
+    // With a daemon running this process is only a thin client
+    int exit_status;
+    if (!opts.daemon && !opts.no_daemon && !opts.cache_stats && !opts.batch_path &&
+        !opts.list_sessions && !opts.prune_sessions && daemon_client(argc, argv, &exit_status)) {
+        return exit_status;
+    }
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    srandom((unsigned)(time(NULL) ^ getpid())); // retry jitter
+
+    const char *config_path = config_file_path();
+    if (!load_config(config_path, &config)) {
+        return 1;
+    }
+    if (opts.cache_stats || opts.list_sessions || opts.prune_sessions) {
+        if (opts.cache_stats) exit_status = print_cache_stats();
+        else exit_status = walk_sessions(opts.prune_sessions ? wall_clock_ms() - (int64_t)(opts.prune_days * 86400000.0) : 0);
+        config_free(&config);
+        return exit_status;
+    }
+    // The daemon picks a backend per client
+    const Backend *backend = opts.daemon ? NULL : select_backend(&opts, stderr);
+    if (!opts.daemon && backend == NULL) {
+        config_free(&config);
+        return 1;
+    }
+
+    if (opts.batch_path) {
+        exit_status = run_batch(opts.batch_path, backend);
+    } else if (opts.daemon) {
+        exit_status = run_daemon(config_path);
+    } else {
+        Session session = { .in = stdin, .out = stdout, .err = stderr, .resume_id = opts.resume_id, .backend = backend };
+        session.stream = opts.stream_set ? opts.stream : config.stream;
+        stats_open(&session, &opts, started);
+        stats_end(&session, PHASE_STARTUP, started, NULL);
+        exit_status = run_session(&session, argc - first_arg, argv + first_arg);
+        stats_finish(&session);
+        session_cleanup(&session);
+    }
+
+    curl_global_cleanup();
+    config_free(&config);
+    return exit_status;
+}
+#endif
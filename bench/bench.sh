@@ -0,0 +1,87 @@
+#!/bin/sh
+# End-to-end latency benchmark: runs scripted sessions of ai against the local mock server
+# and prints p50/p99 per phase as JSON. Usage: bench/bench.sh AI_BINARY MOCK_SERVER
+#
+# Tunables (environment): RUNS sessions, TURNS auto-approved commands per session, DELAY mock delay in ms,
+# SIZE reply size in bytes, STREAM yes/no, COMMAND the command the mock asks for
+
+AI=${1:-./ai}
+MOCK=${2:-bench/mock_server}
+RUNS=${RUNS:-20}
+TURNS=${TURNS:-3}
+DELAY=${DELAY:-0}
+SIZE=${SIZE:-2000}
+STREAM=${STREAM:-no}
+COMMAND=${COMMAND:-echo bench}
+
+WORK=$(mktemp -d /tmp/ai-bench.XXXXXX) || exit 1
+trap 'kill $MOCK_PID 2>/dev/null; rm -rf "$WORK"' EXIT INT TERM
+
+# The mock prints its port first thing
+"$MOCK" -p 0 -d "$DELAY" -s "$SIZE" -c "$COMMAND" -n "$TURNS" > "$WORK/port" &
+MOCK_PID=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -s "$WORK/port" ] && break
+    sleep 0.1
+done
+PORT=$(head -n 1 "$WORK/port")
+if [ -z "$PORT" ]; then
+    echo "Mock server did not start" >&2
+    exit 1
+fi
+
+# Same settings as a fresh install, pointed at the mock, with nothing cached between runs and no hedged duplicates
+sed -e "s#^ENDPOINT=.*##" -e "s#^OPENAIKEY=.*##" -e "s#^STREAM=.*##" -e "s#^CACHE=.*##" -e "s#^CONFIGCACHE=.*##" -e "s#^HEDGEPERCENTILE=.*##" \
+    "$(dirname "$0")/../ai-default.conf" > "$WORK/ai.conf"
+cat >> "$WORK/ai.conf" <<EOF
+OPENAIKEY=bench
+ENDPOINT=http://127.0.0.1:$PORT/v1/chat/completions
+STREAM=$STREAM
+CACHE=no
+CONFIGCACHE=no
+HEDGEPERCENTILE=0
+EOF
+
+# One "yes" per command, then "no" to the offer to continue
+: > "$WORK/answers"
+i=0
+while [ $i -lt "$TURNS" ]; do
+    echo yes >> "$WORK/answers"
+    i=$((i + 1))
+done
+echo no >> "$WORK/answers"
+
+run=0
+while [ $run -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    AI_CONFIG="$WORK/ai.conf" "$AI" --no-daemon --trace "$WORK/trace" benchmark session \
+        < "$WORK/answers" > /dev/null 2>&1 || { echo "ai failed on run $run" >&2; exit 1; }
+    end=$(date +%s%N)
+
+    # Phase events of the trace, durations are in microseconds; waiting on the scripted answers is not ai's time
+    sed -n 's/^{"name":"\([a-z]*\)","cat":"phase","ph":"X","ts":[0-9.]*,"dur":\([0-9.]*\).*/\1 \2/p' "$WORK/trace" |
+        awk '$1 != "input" { printf "%s %.3f\n", $1, $2 / 1000 }' >> "$WORK/phases"
+    awk -v ns=$((end - start)) 'BEGIN { printf "total %.3f\n", ns / 1e6 }' >> "$WORK/phases"
+    run=$((run + 1))
+done
+
+# Nearest-rank percentiles per phase
+sort -k1,1 -k2,2n "$WORK/phases" |
+awk -v runs="$RUNS" -v turns="$TURNS" -v delay="$DELAY" -v size="$SIZE" -v stream="$STREAM" '
+function flush() {
+    if (n == 0) return
+    p50 = v[int((n * 50 + 99) / 100)]
+    p99 = v[int((n * 99 + 99) / 100)]
+    printf "%s\n    \"%s\": {\"count\": %d, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"mean_ms\": %.3f, \"max_ms\": %.3f}",
+           sep, phase, n, p50, p99, sum / n, v[n]
+    sep = ","
+    n = 0
+    sum = 0
+}
+BEGIN {
+    printf "{\n  \"runs\": %d, \"turns\": %d, \"delay_ms\": %d, \"reply_bytes\": %d, \"stream\": %s,\n  \"phases\": {",
+           runs, turns, delay, size, stream == "yes" ? "true" : "false"
+}
+$1 != phase { flush(); phase = $1 }
+{ v[++n] = $2; sum += $2 }
+END { flush(); printf "\n  }\n}\n" }'
@@ -0,0 +1,205 @@
+/*
+ * ============================================================================
+ * Program: AI Linux Assistant - fuzzing of the command scan for make fuzz
+ *
+ * ai.c is built into this driver with AI_NO_MAIN. Random replies made of
+ * tags, fences, shell names, stray '<' and '`' and filler go through
+ * find_markup and collect_commands with the AVX2, SSE2 and scalar paths
+ * forced in turn (the ones the CPU has), and are checked against byte at a
+ * time references: a strchr-like loop and the strstr/strndup collection
+ * ai.c used before the single pass.
+ *
+ * Every reply is copied so that it ends right before an inaccessible page,
+ * a vectorized load running past its page faults instead of going unseen.
+ * Every 1000th reply is a few megabytes long.
+ *
+ * Options:
+ *  -n COUNT   replies to try, 100000 by default
+ *  -s SEED    seed of the generator, the one used is printed
+ * ============================================================================
+ */
+
+#define AI_NO_MAIN
+#include "../ai.c"
+
+#define MAX_REPLY (6 << 20)
+
+typedef struct {
+    const char *name;
+    const char *(*find)(const char *s);
+} MarkupPath;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static const char *find_markup_reference(const char *s) {
+    while (*s && *s != '<' && *s != '`') s++;
+    return s;
+}
+
+// Function to make up a reply of about size bytes, small ones are dense with markup, big ones mostly filler
+static size_t build_reply(char *out, size_t size) {
+    static const char *const pieces[] = {
+        "<CMD>", "</CMD>", "```", "``", "`", "<", "</CMD", "<CM", "CMD>", "<<CMD>", "bash\n", "sh\n", "shell\n",
+        "zsh\n", "console\n", "python\n", "ls -la /tmp ", "\n", "\t", "é", "ü€", "journalctl -u nginx | tail ",
+        "The quick brown fox jumps over the lazy dog. ",
+    };
+    static const char filler[] = "Check the service status, then compare it with the configuration file. ";
+    size_t length = 0;
+    bool sparse = size > 65536;
+    while (length < size) {
+        const char *piece;
+        if (sparse && rng_next() % 64 != 0) {
+            piece = filler;
+        } else if (rng_next() % 16 == 0) {
+            char byte = (char)(rng_next() % 255 + 1);
+            out[length++] = byte;
+            continue;
+        } else {
+            piece = pieces[rng_next() % (sizeof(pieces) / sizeof(pieces[0]))];
+        }
+        size_t piece_length = strlen(piece);
+        if (length + piece_length > size) break;
+        memcpy(out + length, piece, piece_length);
+        length += piece_length;
+    }
+    out[length] = '\0';
+    return length;
+}
+
+// The collection as it was before the single pass: strstr for the tags, then the fences stripped from each
+// command, the shell name right after the first of them too
+static int collect_reference(const char *reply, char ***out) {
+    static const char *const fence_languages[] = { "bash\n", "sh\n", "shell\n", "zsh\n", "console\n" };
+    char **commands = NULL;
+    int count = 0;
+    const char *start = strstr(reply, "<CMD>");
+    while (start) {
+        start += strlen("<CMD>");
+        const char *end = strstr(start, "</CMD>");
+        if (end == NULL) break;
+
+        char *command = strndup(start, end - start);
+        char *src = command, *dst = command;
+        bool fenced = false;
+        while (*src) {
+            if (strncmp(src, "```", 3) != 0) {
+                *dst++ = *src++;
+                continue;
+            }
+            src += 3;
+            for (size_t l = 0; !fenced && l < sizeof(fence_languages) / sizeof(fence_languages[0]); l++) {
+                if (strncmp(src, fence_languages[l], strlen(fence_languages[l])) == 0) {
+                    src += strlen(fence_languages[l]);
+                    break;
+                }
+            }
+            fenced = true;
+        }
+        *dst = '\0';
+
+        commands = realloc(commands, (count + 1) * sizeof(char *));
+        commands[count++] = command;
+        start = strstr(end + strlen("</CMD>"), "<CMD>");
+    }
+    *out = commands;
+    return count;
+}
+
+// Function to print the reply a path got wrong, escaped and cut short
+static void report(const char *path, const char *reply, uint64_t seed, long iteration) {
+    fprintf(stderr, "%s path differs on reply %ld (seed %llu): \"", path, iteration, (unsigned long long)seed);
+    for (const char *p = reply; *p && p - reply < 400; p++) {
+        if (*p == '\n') fputs("\\n", stderr);
+        else if ((unsigned char)*p < 0x20) fprintf(stderr, "\\x%02x", (unsigned char)*p);
+        else fputc(*p, stderr);
+    }
+    fputs("\"\n", stderr);
+}
+
+// Function to check one path on one reply, every hit on the way to the end has to match the reference
+static bool check_path(const MarkupPath *path, const char *reply, char **expected, int expected_count) {
+    for (const char *p = reply; ; p++) {
+        const char *hit = path->find(p);
+        if (hit != find_markup_reference(p)) return false;
+        if (*hit == '\0') break;
+        p = hit;
+    }
+
+    CommandList list;
+    find_markup_forced = path->find;
+    bool same = collect_commands(reply, &list) && list.count == expected_count;
+    find_markup_forced = NULL;
+    for (int i = 0; same && i < expected_count; i++) same = strcmp(list.commands[i], expected[i]) == 0;
+    command_list_free(&list);
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 100000;
+    uint64_t seed = (uint64_t)time(NULL);
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atol(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n count] [-s seed]\n", argv[0]);
+                return 1;
+        }
+    }
+    rng_state = seed ? seed : 1;
+
+    MarkupPath paths[3];
+    int path_count = 0;
+#ifdef __SSE2__
+    if (__builtin_cpu_supports("avx2")) paths[path_count++] = (MarkupPath){ "avx2", find_markup_avx2 };
+    paths[path_count++] = (MarkupPath){ "sse2", find_markup_sse2 };
+#endif
+    paths[path_count++] = (MarkupPath){ "scalar", find_markup_reference };
+
+    // The replies are written at the end of this mapping, right before its last page which is made inaccessible
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t area = (MAX_REPLY + 1 + page - 1) / page * page;
+    char *mapping = mmap(NULL, area + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    char *scratch = malloc(MAX_REPLY + 1);
+    if (mapping == MAP_FAILED || scratch == NULL || mprotect(mapping + area, page, PROT_NONE) != 0) {
+        perror("Failed to map the reply area");
+        return 1;
+    }
+
+    printf("Fuzzing %ld replies with seed %llu on:", iterations, (unsigned long long)seed);
+    for (int i = 0; i < path_count; i++) printf(" %s", paths[i].name);
+    printf("\n");
+    fflush(stdout);
+
+    long failures = 0;
+    for (long n = 0; n < iterations && failures < 10; n++) {
+        size_t size = n % 1000 == 999 ? (1 << 20) + rng_next() % (MAX_REPLY - (1 << 20)) : rng_next() % 4096;
+        size_t length = build_reply(scratch, size);
+        char *reply = mapping + area - length - 1;
+        memcpy(reply, scratch, length + 1);
+
+        char **expected;
+        int expected_count = collect_reference(reply, &expected);
+        for (int i = 0; i < path_count; i++) {
+            if (!check_path(&paths[i], reply, expected, expected_count)) {
+                report(paths[i].name, reply, seed, n);
+                failures++;
+            }
+        }
+        for (int i = 0; i < expected_count; i++) free(expected[i]);
+        free(expected);
+    }
+
+    free(scratch);
+    munmap(mapping, area + page);
+    printf("%ld mismatch%s\n", failures, failures == 1 ? "" : "es");
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,460 @@
+/*
+ * ============================================================================
+ * Program: AI Linux Assistant - microbenchmarks for make microbench
+ *
+ * ai.c is built into this driver with AI_NO_MAIN, so its hot functions run
+ * on synthetic input: histories of 10 to 25,000 messages, command outputs
+ * and replies of 100 B to 64 KB, replies with commands of up to 8 MB and
+ * config files with many PROMPT= lines.
+ * No terminal, API or config file is needed.
+ *
+ * Every scenario runs in its own process, so the peak RSS it reports is its
+ * own. Per scenario it prints ns/op (the fastest of 7 rounds, the others
+ * only caught more noise), allocations and bytes allocated per op, and the
+ * peak RSS.
+ *
+ * Options:
+ *  -b FILE    compare with this baseline, the run fails when it is missing
+ *  -w         write the baseline to that file instead, for this machine
+ *  -t PCT     how much slower than the baseline a scenario may get, or how
+ *             many more allocations or bytes it may allocate, before the
+ *             run fails, 25 by default
+ *  -m MS      time spent per round, 50 by default
+ *  -f TEXT    only the scenarios whose name contains TEXT
+ *  -o FILE    also write the results there as JSON
+ * ============================================================================
+ */
+
+#define AI_NO_MAIN
+#include "../ai.c"
+
+#include <sys/resource.h>
+
+#define ROUNDS 7
+#define MAX_SCENARIOS 64
+
+// Every allocation goes through these, glibc's own calls included, so json-c and strdup are counted too
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, count * size, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&alloc_bytes, size, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+// One benchmark: setup builds the input once, run does the work and says how many ops that was
+typedef struct {
+    char name[64];
+    long size;
+    void (*setup)(long size);
+    size_t (*run)(long size);
+    void (*teardown)(void);
+} Scenario;
+
+// What a scenario's process reports back
+typedef struct {
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+    long peak_rss_kb;
+} Result;
+
+static Backend bench_backend = { .name = "default", .api = API_OPENAI, .endpoint = OPENAI_API_URL, .model = "gpt-4o-mini" };
+static Session bench_session;
+static ByteBuffer bench_input;
+static ByteBuffer bench_output;
+static char bench_config_path[64];
+static FILE *bench_null;
+
+static Session new_bench_session(void) {
+    return (Session){ .in = stdin, .out = bench_null, .err = bench_null, .backend = &bench_backend };
+}
+
+static void end_bench_session(Session *s) {
+    session_cleanup(s);
+    memset(s, 0, sizeof(*s));
+}
+
+// Function to make up the i-th message of a conversation: requests, replies with a command, and command results
+static void bench_message(size_t i, ByteBuffer *out, ConversationRole *role) {
+    static const char filler[] = "The \"quick\" brown fox\tjumps over the lazy dog, café 1234. ";
+    out->length = 0;
+    switch (i % 3) {
+        case 0:
+            *role = ROLE_USER;
+            buffer_printf(out, "Question %zu: why is the disk of this server filling up?", i);
+            break;
+        case 1:
+            *role = ROLE_ASSISTANT;
+            buffer_printf(out, "Let's look at the biggest directories first. <CMD>du -xh /var | sort -rh | head -n %zu</CMD>", i % 20 + 1);
+            break;
+        default:
+            *role = ROLE_USER;
+            buffer_printf(out, "command executed: <du -xh /var | sort -rh> status: <executed> output: <");
+            for (size_t n = 0; n < i % 16 + 1; n++) buffer_append(out, filler, strlen(filler));
+            buffer_printf(out, "> timing: <spawn 0.3ms, first output 2.1ms, exit 4.0ms, total 4.1ms>");
+            break;
+    }
+}
+
+static void build_history(Session *s, long entries) {
+    ByteBuffer text = {0};
+    ConversationRole role;
+    append_conversation_entry(s, ROLE_SYSTEM, "You are a Linux assistant. Put every command in <CMD></CMD>.");
+    for (long i = 0; i < entries; i++) {
+        bench_message(i, &text, &role);
+        append_conversation_entry(s, role, text.data);
+    }
+    buffer_free(&text);
+}
+
+// Function to make up a command output: log lines, some of them repeated, with colors and a progress bar
+static void build_output(long size, ByteBuffer *out) {
+    out->length = 0;
+    for (long i = 0; (long)out->length < size; i++) {
+        if (i % 50 == 0) {
+            buffer_printf(out, "\x1b[1;32mprogress\x1b[0m 10%%\r50%%\r100%%\n");
+        } else if (i % 7 < 4) {
+            buffer_printf(out, "Oct 16 10:%02ld:%02ld host kernel: eth0: link up, 1000Mbps, full duplex\n", i / 60 % 60, i % 60);
+        } else {
+            buffer_printf(out, "Oct 16 10:%02ld:%02ld host sshd[%ld]: Accepted \"publickey\" for user%ld\t\n", i / 60 % 60, i % 60, 1000 + i, i);
+        }
+    }
+    out->length = size;
+    out->data[size] = '\0';
+}
+
+// Appending: ns per message over building a whole history
+static size_t run_append(long entries) {
+    Session s = new_bench_session();
+    build_history(&s, entries);
+    end_bench_session(&s);
+    return entries + 1;
+}
+
+static void setup_payload(long entries) {
+    bench_session = new_bench_session();
+    build_history(&bench_session, entries);
+}
+
+static size_t run_payload(long entries) {
+    if (generate_json_payload(&bench_session) == NULL) abort();
+    return 1;
+}
+
+static void teardown_session(void) {
+    end_bench_session(&bench_session);
+}
+
+static void setup_parse(long size) {
+    ByteBuffer content = {0};
+    build_output(size, &content);
+    bench_input.length = 0;
+    buffer_printf(&bench_input, "{\"id\":\"chatcmpl-1\",\"object\":\"chat.completion\",\"choices\":[{\"index\":0,"
+                                "\"message\":{\"role\":\"assistant\",\"content\":\"");
+    buffer_reserve(&bench_input, json_escaped_length(content.data, content.length));
+    bench_input.length = json_escape(bench_input.data + bench_input.length, content.data, content.length) - bench_input.data;
+    buffer_printf(&bench_input, "\"},\"finish_reason\":\"stop\"}],\"usage\":{\"total_tokens\":42}}");
+    buffer_free(&content);
+    bench_session = new_bench_session();
+}
+
+static size_t run_parse(long size) {
+    char *content = parse_ai_response(&bench_session, bench_input.data);
+    if (content == NULL) abort();
+    free(content);
+    return 1;
+}
+
+static void setup_output(long size) {
+    build_output(size, &bench_input);
+}
+
+static size_t run_escape(long size) {
+    bench_output.length = 0;
+    if (!buffer_reserve(&bench_output, json_escaped_length(bench_input.data, bench_input.length))) abort();
+    bench_output.length = json_escape(bench_output.data, bench_input.data, bench_input.length) - bench_output.data;
+    return 1;
+}
+
+static size_t run_reduce(long size) {
+    bench_output.length = 0;
+    if (!output_reduce(bench_input.data, bench_input.length, &bench_output)) abort();
+    return 1;
+}
+
+// A reply with fenced commands spread through the text
+static void setup_reply(long size) {
+    bench_input.length = 0;
+    for (long i = 0; (long)bench_input.length < size; i++) {
+        if (i % 8 == 7) {
+            buffer_printf(&bench_input, "<CMD>```bash\njournalctl -u nginx --since \"-%ldmin\" | tail -n 20```</CMD>\n", i);
+        } else {
+            buffer_printf(&bench_input, "Step %ld: check the `service` status and compare it with the config. ", i);
+        }
+    }
+}
+
+static size_t run_commands(long size) {
+    CommandList list = {0};
+    if (!collect_commands(bench_input.data, &list)) abort();
+    command_list_free(&list);
+    return 1;
+}
+
+static void setup_config(long prompts) {
+    snprintf(bench_config_path, sizeof(bench_config_path), "/tmp/ai-microbench-%d.conf", (int)getpid());
+    FILE *f = fopen(bench_config_path, "w");
+    if (f == NULL) abort();
+    fprintf(f, "OPENAIKEY=sk-bench\nMODEL=gpt-4o-mini\nCONFIGCACHE=no\nREADONLY=ls\nREADONLY=systemctl status *\n");
+    for (long i = 0; i < prompts; i++) {
+        fprintf(f, "PROMPT=Rule %ld: always explain what a command does before proposing it, and never run rm -rf.\n", i);
+    }
+    fprintf(f, "[local]\nAPI=ollama\nMODEL=llama3.2\n");
+    fclose(f);
+}
+
+static size_t run_config(long prompts) {
+    AiConfig cfg;
+    if (!load_config(bench_config_path, &cfg)) abort();
+    config_free(&cfg);
+    return 1;
+}
+
+static void teardown_config(void) {
+    unlink(bench_config_path);
+}
+
+static int add_scenarios(Scenario *list, int count, const char *name, const long *sizes, int size_count,
+                         void (*setup)(long), size_t (*run)(long), void (*teardown)(void)) {
+    for (int i = 0; i < size_count && count < MAX_SCENARIOS; i++, count++) {
+        list[count] = (Scenario){ .size = sizes[i], .setup = setup, .run = run, .teardown = teardown };
+        snprintf(list[count].name, sizeof(list[count].name), name, sizes[i]);
+    }
+    return count;
+}
+
+// Function to time one scenario: the op count per round is doubled until a round takes long enough,
+// then the fastest round is kept. Allocations are counted over all of them
+static Result measure(const Scenario *sc, double round_ms) {
+    Result r = {0};
+    if (sc->setup) sc->setup(sc->size);
+    sc->run(sc->size); // warm-up
+
+    size_t reps = 1;
+    for (;;) {
+        double start = monotonic_ms();
+        for (size_t i = 0; i < reps; i++) sc->run(sc->size);
+        if (monotonic_ms() - start >= round_ms / 4 || reps >= (1u << 30)) break;
+        reps *= 2;
+    }
+
+    double samples[ROUNDS];
+    uint64_t ops = 0;
+    uint64_t allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED), bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED);
+    for (int round = 0; round < ROUNDS; round++) {
+        uint64_t round_ops = 0;
+        double start = monotonic_ms();
+        for (size_t i = 0; i < reps * 4; i++) round_ops += sc->run(sc->size);
+        samples[round] = (monotonic_ms() - start) * 1e6 / round_ops;
+        ops += round_ops;
+    }
+    allocs = __atomic_load_n(&alloc_count, __ATOMIC_RELAXED) - allocs;
+    bytes = __atomic_load_n(&alloc_bytes, __ATOMIC_RELAXED) - bytes;
+    if (sc->teardown) sc->teardown();
+
+    r.ns_per_op = samples[0];
+    for (int i = 1; i < ROUNDS; i++) {
+        if (samples[i] < r.ns_per_op) r.ns_per_op = samples[i];
+    }
+    r.allocs_per_op = (double)allocs / ops;
+    r.bytes_per_op = (double)bytes / ops;
+    return r;
+}
+
+// Function to run a scenario in a child process, its rusage gives the peak RSS of that scenario alone
+static bool run_isolated(const Scenario *sc, double round_ms, Result *result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("Pipe failed");
+        return false;
+    }
+
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        Result r = measure(sc, round_ms);
+        _exit(write_full(fds[1], &r, sizeof(r)) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t n = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || n != sizeof(*result)) {
+        fprintf(stderr, "Scenario %s failed\n", sc->name);
+        return false;
+    }
+    result->peak_rss_kb = usage.ru_maxrss;
+    return true;
+}
+
+// The baseline is one line per scenario: name, ns/op, allocations/op and bytes/op
+static bool find_baseline(const char *path, const char *name, Result *base) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return false;
+    char line[256], entry[64];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+        found = sscanf(line, "%63s %lf %lf %lf", entry, &base->ns_per_op, &base->allocs_per_op, &base->bytes_per_op) == 4 &&
+                strcmp(entry, name) == 0;
+    }
+    fclose(f);
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    const char *baseline = NULL, *filter = NULL, *json_path = NULL;
+    bool write_baseline = false;
+    double threshold = 25, round_ms = 50;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:wt:m:f:o:")) != -1) {
+        switch (opt) {
+            case 'b': baseline = optarg; break;
+            case 'w': write_baseline = true; break;
+            case 't': threshold = atof(optarg); break;
+            case 'm': round_ms = atof(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'o': json_path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-b baseline] [-w] [-t percent] [-m ms] [-f filter] [-o results.json]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    // The defaults of a fresh install, minus anything that touches the disk or the network
+    config_set_defaults(&config);
+    config.sessions = false;
+    config.summarize = false;
+    bench_null = fopen("/dev/null", "w");
+
+    static const long histories[] = { 10, 100, 1000, 25000 };
+    static const long sizes[] = { 100, 4096, 65536 };
+    static const long replies[] = { 100, 4096, 65536, 8 << 20 };
+    static const long prompts[] = { 10, 100, 1000, 10000 };
+    Scenario scenarios[MAX_SCENARIOS];
+    int count = 0;
+    count = add_scenarios(scenarios, count, "append/history=%ld", histories, 4, NULL, run_append, NULL);
+    count = add_scenarios(scenarios, count, "payload/history=%ld", histories, 4, setup_payload, run_payload, teardown_session);
+    count = add_scenarios(scenarios, count, "parse/reply=%ld", sizes, 3, setup_parse, run_parse, teardown_session);
+    count = add_scenarios(scenarios, count, "escape/output=%ld", sizes, 3, setup_output, run_escape, NULL);
+    count = add_scenarios(scenarios, count, "reduce/output=%ld", sizes, 3, setup_output, run_reduce, NULL);
+    count = add_scenarios(scenarios, count, "commands/reply=%ld", replies, 4, setup_reply, run_commands, NULL);
+    count = add_scenarios(scenarios, count, "config/prompts=%ld", prompts, 4, setup_config, run_config, teardown_config);
+
+    // Timings only mean something against the same machine, so a missing baseline is never made up on the fly
+    bool compare = baseline && !write_baseline;
+    if (compare && access(baseline, R_OK) != 0) {
+        fprintf(stderr, "No baseline at %s, make microbench-baseline writes one for this machine\n", baseline);
+        return 1;
+    }
+    FILE *baseline_out = NULL;
+    if (write_baseline && (baseline == NULL || (baseline_out = fopen(baseline, "w")) == NULL)) {
+        if (baseline) perror("Failed to write the baseline");
+        else fprintf(stderr, "-w needs -b FILE\n");
+        return 1;
+    }
+
+    ByteBuffer json = {0};
+    buffer_printf(&json, "{\n  \"round_ms\": %.0f, \"rounds\": %d,\n  \"scenarios\": {", round_ms, ROUNDS);
+    printf("%-24s %14s %12s %14s %12s\n", "scenario", "ns/op", "allocs/op", "bytes/op", "peak RSS kB");
+
+    int failed = 0, regressions = 0;
+    const char *sep = "";
+    for (int i = 0; i < count; i++) {
+        const Scenario *sc = &scenarios[i];
+        if (filter && strstr(sc->name, filter) == NULL) continue;
+
+        Result r, base;
+        if (!run_isolated(sc, round_ms, &r)) {
+            failed++;
+            continue;
+        }
+
+        // A slow result is measured again before it counts, a busy machine slows a whole process down at times
+        bool has_base = compare && find_baseline(baseline, sc->name, &base);
+        double limit = 1 + threshold / 100;
+        for (int retry = 0; has_base && retry < 2 && r.ns_per_op > base.ns_per_op * limit; retry++) {
+            Result again;
+            if (run_isolated(sc, round_ms, &again) && again.ns_per_op < r.ns_per_op) r.ns_per_op = again.ns_per_op;
+        }
+
+        printf("%-24s %14.1f %12.2f %14.1f %12ld\n", sc->name, r.ns_per_op, r.allocs_per_op, r.bytes_per_op, r.peak_rss_kb);
+        fflush(stdout);
+        buffer_printf(&json, "%s\n    \"%s\": {\"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f, \"peak_rss_kb\": %ld}",
+                      sep, sc->name, r.ns_per_op, r.allocs_per_op, r.bytes_per_op, r.peak_rss_kb);
+        sep = ",";
+
+        if (baseline_out) fprintf(baseline_out, "%s %.1f %.2f %.1f\n", sc->name, r.ns_per_op, r.allocs_per_op, r.bytes_per_op);
+        if (!has_base) continue;
+
+        if (r.ns_per_op > base.ns_per_op * limit) {
+            fprintf(stderr, "Regression in %s: %.1f ns/op, the baseline is %.1f (+%.0f%%)\n", sc->name, r.ns_per_op,
+                    base.ns_per_op, (r.ns_per_op / base.ns_per_op - 1) * 100);
+            regressions++;
+        }
+        // Allocations barely move between runs, a small absolute slack keeps rounding from failing them
+        if (r.allocs_per_op > base.allocs_per_op * limit + 0.5) {
+            fprintf(stderr, "Regression in %s: %.2f allocations/op, the baseline is %.2f\n", sc->name, r.allocs_per_op,
+                    base.allocs_per_op);
+            regressions++;
+        }
+        if (r.bytes_per_op > base.bytes_per_op * limit + 64) {
+            fprintf(stderr, "Regression in %s: %.1f bytes allocated/op, the baseline is %.1f\n", sc->name, r.bytes_per_op,
+                    base.bytes_per_op);
+            regressions++;
+        }
+    }
+    buffer_printf(&json, "\n  }\n}\n");
+
+    if (json_path) {
+        FILE *f = fopen(json_path, "w");
+        if (f == NULL || fwrite(json.data, 1, json.length, f) != json.length) perror("Failed to write the results");
+        if (f) fclose(f);
+    }
+    buffer_free(&json);
+
+    if (baseline_out) {
+        fclose(baseline_out);
+        printf("Baseline written to %s\n", baseline);
+    } else if (compare) {
+        printf("%d regression%s over %.0f%% against %s\n", regressions, regressions == 1 ? "" : "s", threshold, baseline);
+    }
+    return failed > 0 || regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * ============================================================================
+ * Program: AI Linux Assistant - mock chat completions server for make bench
+ *
+ * Answers POST requests on 127.0.0.1 like the OpenAI chat completions
+ * endpoint does, so ai's own overhead can be measured without paying for
+ * or waiting on the real API. The port is printed on the first line of
+ * stdout (use -p 0 for any free port).
+ *
+ * Options:
+ *  -p PORT    port to listen on, 0 picks a free one
+ *  -d MS      delay before the reply starts
+ *  -s BYTES   size of the reply text
+ *  -k BYTES   size of one streamed chunk
+ *  -i MS      delay between streamed chunks
+ *  -c CMD     command put in a <CMD></CMD> block of the reply
+ *  -n TURNS   only the first TURNS replies of a conversation carry the command
+ *
+ * Requests with "stream":true get server-sent events, gzip bodies are accepted.
+ * ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#define MAX_HEADER_SIZE (16 * 1024)
+
+// What every reply looks like, set once from the command line
+typedef struct {
+    int port;
+    int delay_ms;
+    size_t size;
+    size_t chunk;
+    int chunk_delay_ms;
+    const char *command;
+    int command_turns;
+} MockConfig;
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} ByteBuffer;
+
+static MockConfig mock = { .port = 0, .size = 2000, .chunk = 32, .command_turns = 1 };
+
+static bool buffer_append(ByteBuffer *buf, const void *data, size_t length) {
+    if (buf->length + length + 1 > buf->capacity) {
+        size_t new_capacity = buf->capacity ? buf->capacity : 4096;
+        while (new_capacity < buf->length + length + 1) new_capacity *= 2;
+        char *new_data = realloc(buf->data, new_capacity);
+        if (new_data == NULL) return false;
+        buf->data = new_data;
+        buf->capacity = new_capacity;
+    }
+    memcpy(buf->data + buf->length, data, length);
+    buf->length += length;
+    buf->data[buf->length] = '\0';
+    return true;
+}
+
+static bool write_full(int fd, const void *data, size_t length) {
+    const char *p = data;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+static void sleep_ms(int ms) {
+    if (ms > 0) usleep(ms * 1000);
+}
+
+// Function to inflate a gzip request body in place
+static bool gunzip(ByteBuffer *body) {
+    ByteBuffer out = {0};
+    z_stream zs = {0};
+    if (inflateInit2(&zs, 15 + 16) != Z_OK) return false;
+
+    zs.next_in = (Bytef *)body->data;
+    zs.avail_in = body->length;
+    int rc = Z_OK;
+    char chunk[65536];
+    while (rc == Z_OK) {
+        zs.next_out = (Bytef *)chunk;
+        zs.avail_out = sizeof(chunk);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        if ((rc == Z_OK || rc == Z_STREAM_END) && !buffer_append(&out, chunk, sizeof(chunk) - zs.avail_out)) rc = Z_MEM_ERROR;
+    }
+    inflateEnd(&zs);
+
+    free(body->data);
+    *body = out;
+    return rc == Z_STREAM_END;
+}
+
+// Function to build the reply text: the command for the first turns, then filler up to the requested size
+static void build_reply(const char *request, ByteBuffer *reply) {
+    int turn = 0;
+    for (const char *p = request; (p = strstr(p, "\"role\":\"user\"")) != NULL; p++) turn++;
+
+    if (mock.command && turn <= mock.command_turns) {
+        buffer_append(reply, "Running it now. <CMD>", strlen("Running it now. <CMD>"));
+        buffer_append(reply, mock.command, strlen(mock.command));
+        buffer_append(reply, "</CMD>", strlen("</CMD>"));
+    }
+
+    static const char filler[] = "The quick brown fox jumps over the lazy dog. ";
+    while (reply->length < mock.size) {
+        size_t n = mock.size - reply->length;
+        buffer_append(reply, filler, n < strlen(filler) ? n : strlen(filler));
+    }
+}
+
+// Function to append text as the inside of a JSON string
+static void json_append_escaped(ByteBuffer *out, const char *s, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        char c = s[i];
+        if (c == '"' || c == '\\') {
+            char escaped[2] = { '\\', c };
+            buffer_append(out, escaped, 2);
+        } else if (c == '\n') {
+            buffer_append(out, "\\n", 2);
+        } else if ((unsigned char)c >= 0x20) {
+            buffer_append(out, &c, 1);
+        }
+    }
+}
+
+static bool send_chunk(int fd, const char *data, size_t length) {
+    char size_line[32];
+    int n = snprintf(size_line, sizeof(size_line), "%zx\r\n", length);
+    return write_full(fd, size_line, n) && write_full(fd, data, length) && write_full(fd, "\r\n", 2);
+}
+
+// Function to answer one completion request, streamed or in one body
+static bool answer(int fd, const char *request) {
+    ByteBuffer reply = {0}, out = {0};
+    bool stream = strstr(request, "\"stream\":true") != NULL;
+    bool ok = true;
+
+    build_reply(request, &reply);
+    sleep_ms(mock.delay_ms);
+
+    if (stream) {
+        static const char headers[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nTransfer-Encoding: chunked\r\n\r\n";
+        ok = write_full(fd, headers, strlen(headers));
+        for (size_t i = 0; ok && i < reply.length; i += mock.chunk) {
+            size_t n = reply.length - i < mock.chunk ? reply.length - i : mock.chunk;
+            out.length = 0;
+            buffer_append(&out, "data: {\"choices\":[{\"delta\":{\"content\":\"", strlen("data: {\"choices\":[{\"delta\":{\"content\":\""));
+            json_append_escaped(&out, reply.data + i, n);
+            buffer_append(&out, "\"}}]}\n\n", strlen("\"}}]}\n\n"));
+            ok = send_chunk(fd, out.data, out.length);
+            if (i + n < reply.length) sleep_ms(mock.chunk_delay_ms);
+        }
+        ok = ok && send_chunk(fd, "data: [DONE]\n\n", strlen("data: [DONE]\n\n")) && write_full(fd, "0\r\n\r\n", 5);
+    } else {
+        ByteBuffer body = {0};
+        buffer_append(&body, "{\"choices\":[{\"message\":{\"role\":\"assistant\",\"content\":\"",
+                      strlen("{\"choices\":[{\"message\":{\"role\":\"assistant\",\"content\":\""));
+        json_append_escaped(&body, reply.data, reply.length);
+        buffer_append(&body, "\"}}]}", strlen("\"}}]}"));
+
+        char headers[256];
+        int n = snprintf(headers, sizeof(headers),
+                         "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", body.length);
+        ok = write_full(fd, headers, n) && write_full(fd, body.data, body.length);
+        free(body.data);
+    }
+
+    free(reply.data);
+    free(out.data);
+    return ok;
+}
+
+// Function to serve one keep-alive connection until the client goes away
+static void *serve_connection(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    ByteBuffer in = {0};
+    char chunk[65536];
+
+    for (;;) {
+        // Read up to the end of the headers
+        char *header_end;
+        while ((header_end = in.data ? strstr(in.data, "\r\n\r\n") : NULL) == NULL && in.length < MAX_HEADER_SIZE) {
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) goto done;
+            buffer_append(&in, chunk, n);
+        }
+        if (header_end == NULL) break;
+
+        size_t header_length = header_end + 4 - in.data;
+        size_t content_length = 0;
+        bool gzip = false, post = strncmp(in.data, "POST ", 5) == 0;
+        for (char *line = strstr(in.data, "\r\n"); line && line < header_end; ) {
+            char *field = line + 2, *line_end = strstr(field, "\r\n");
+            if (strncasecmp(field, "Content-Length:", 15) == 0) content_length = strtoul(field + 15, NULL, 10);
+            if (strncasecmp(field, "Content-Encoding:", 17) == 0 && memmem(field, line_end - field, "gzip", 4)) gzip = true;
+            line = line_end;
+        }
+
+        while (in.length < header_length + content_length) {
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) goto done;
+            buffer_append(&in, chunk, n);
+        }
+
+        ByteBuffer body = {0};
+        buffer_append(&body, in.data + header_length, content_length);
+        bool ok = !gzip || gunzip(&body);
+        if (!post || !ok) {
+            static const char empty[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n";
+            ok = write_full(fd, empty, strlen(empty));
+        } else {
+            ok = answer(fd, body.data ? body.data : "");
+        }
+        free(body.data);
+        if (!ok) break;
+
+        // Keep whatever the client already sent for the next request
+        size_t consumed = header_length + content_length;
+        memmove(in.data, in.data + consumed, in.length - consumed);
+        in.length -= consumed;
+        in.data[in.length] = '\0';
+    }
+
+done:
+    free(in.data);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:d:s:k:i:c:n:")) != -1) {
+        switch (opt) {
+            case 'p': mock.port = atoi(optarg); break;
+            case 'd': mock.delay_ms = atoi(optarg); break;
+            case 's': mock.size = strtoul(optarg, NULL, 10); break;
+            case 'k': mock.chunk = strtoul(optarg, NULL, 10); break;
+            case 'i': mock.chunk_delay_ms = atoi(optarg); break;
+            case 'c': mock.command = optarg; break;
+            case 'n': mock.command_turns = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-d ms] [-s bytes] [-k bytes] [-i ms] [-c command] [-n turns]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (mock.chunk == 0) mock.chunk = 1;
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(mock.port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 64) != 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        perror("Failed to listen");
+        return 1;
+    }
+    printf("%d\n", ntohs(addr.sin_port));
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to accept connection");
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, (void *)(intptr_t)fd) == 0) {
+            pthread_detach(thread);
+        } else {
+            close(fd);
+        }
+    }
+}